@@ -0,0 +1,139 @@
+// embed_web.cpp
+// Build-time tool: turns the web/ folder into a C++ source with every file as a constexpr byte array,
+// its ETag and gzip/brotli variants, so the server needs no files next to it.
+// Usage: embed_web <web_dir> <out.cpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+static bool read_file(const std::string &path, std::string &out) {
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) return false;
+    std::ostringstream ss;
+    ss << ifs.rdbuf();
+    out = ss.str();
+    return true;
+}
+
+// relative paths of all regular files under root, sorted so the output is reproducible
+static void list_files(const std::string &root, const std::string &rel, std::vector<std::string> &out) {
+    std::string dir = rel.empty() ? root : root + "/" + rel;
+    DIR *d = opendir(dir.c_str());
+    if (!d) return;
+    while (struct dirent *e = readdir(d)) {
+        std::string name = e->d_name;
+        if (name.empty() || name[0] == '.') continue;
+        std::string rel_path = rel.empty() ? name : rel + "/" + name;
+        struct stat st;
+        if (stat((root + "/" + rel_path).c_str(), &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) list_files(root, rel_path, out);
+        else if (S_ISREG(st.st_mode)) out.push_back(rel_path);
+    }
+    closedir(d);
+    std::sort(out.begin(), out.end());
+}
+
+static std::string sha256_hex(const std::string &data) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_Digest(data.data(), data.size(), md, &len, EVP_sha256(), NULL);
+    static const char hex[] = "0123456789abcdef";
+    std::string s;
+    for (unsigned int i = 0; i < len; ++i) { s += hex[md[i] >> 4]; s += hex[md[i] & 15]; }
+    return s;
+}
+
+static bool gzip_compress(const std::string &in, std::string &out) {
+    z_stream zs{};
+    if (deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+    out.resize(deflateBound(&zs, in.size()));
+    zs.next_in = (Bytef*)in.data();
+    zs.avail_in = (uInt)in.size();
+    zs.next_out = (Bytef*)&out[0];
+    zs.avail_out = (uInt)out.size();
+    bool ok = deflate(&zs, Z_FINISH) == Z_STREAM_END;
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return ok;
+}
+
+static bool brotli_compress(const std::string &in, std::string &out) {
+#ifdef HAVE_BROTLI
+    size_t n = BrotliEncoderMaxCompressedSize(in.size());
+    if (n == 0) return false;
+    out.resize(n);
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_MAX_WINDOW_BITS, BROTLI_MODE_TEXT,
+                               in.size(), (const uint8_t*)in.data(), &n, (uint8_t*)&out[0])) return false;
+    out.resize(n);
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void write_array(std::ostream &os, const std::string &name, const std::string &data) {
+    os << "constexpr unsigned char " << name << "[] = {";
+    if (data.empty()) os << "0";
+    for (size_t i = 0; i < data.size(); ++i) {
+        if (i % 16 == 0) os << "\n   ";
+        os << ' ' << (unsigned)(unsigned char)data[i] << ',';
+    }
+    os << "\n};\n";
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <web_dir> <out.cpp>\n";
+        return 1;
+    }
+    std::string root = argv[1], out_path = argv[2];
+    std::vector<std::string> files;
+    list_files(root, "", files);
+    if (files.empty()) { std::cerr << "embed_web: no files in " << root << "\n"; return 1; }
+
+    std::ostringstream os, table;
+    os << "// generated by embed_web from the web/ folder, do not edit\n"
+       << "#include \"web_assets.h\"\n\nnamespace {\n";
+    for (size_t i = 0; i < files.size(); ++i) {
+        std::string body;
+        if (!read_file(root + "/" + files[i], body)) { std::cerr << "embed_web: cannot read " << files[i] << "\n"; return 1; }
+        std::string base = "a" + std::to_string(i), gz, br;
+        // variants are kept only when smaller; the server decides which content types get them
+        bool has_gz = gzip_compress(body, gz) && gz.size() < body.size();
+        bool has_br = brotli_compress(body, br) && br.size() < body.size();
+        os << "// " << files[i] << "\n";
+        write_array(os, base, body);
+        if (has_gz) write_array(os, base + "_gz", gz);
+        if (has_br) write_array(os, base + "_br", br);
+        table << "    {\"/" << files[i] << "\", \"\\\"" << sha256_hex(body).substr(0, 16) << "\\\"\", "
+              << base << ", " << body.size() << ", "
+              << (has_gz ? base + "_gz" : "nullptr") << ", " << (has_gz ? gz.size() : 0) << ", "
+              << (has_br ? base + "_br" : "nullptr") << ", " << (has_br ? br.size() : 0) << "},\n";
+    }
+    os << "} // namespace\n\nconst EmbeddedAsset kWebAssets[] = {\n" << table.str() << "};\n"
+       << "const size_t kWebAssetCount = " << files.size() << ";\n";
+
+    // leave the file untouched when nothing changed so the server is not recompiled
+    std::string generated = os.str(), previous;
+    if (read_file(out_path, previous) && previous == generated) return 0;
+    std::string tmp = out_path + ".tmp";
+    {
+        std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+        ofs << generated;
+        if (!ofs) { std::cerr << "embed_web: cannot write " << tmp << "\n"; return 1; }
+    }
+    if (std::rename(tmp.c_str(), out_path.c_str()) != 0) { std::cerr << "embed_web: cannot write " << out_path << "\n"; return 1; }
+    return 0;
+}
@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+# fake_clamd.py — stand-in for clamd's LocalSocket, to exercise the scan path without ClamAV.
+#
+#   ./fake_clamd.py <socket>     then "disable_clamav": false, "clamd_socket": "<socket>" in config.json
+#
+# Speaks zINSTREAM only. The reply depends on the uploaded bytes:
+#   contains "EICAR"        -> "stream: Eicar-Test-Signature FOUND"  (photo is quarantined)
+#   contains "SCAN_ERROR"   -> "INSTREAM size limit exceeded. ERROR" (retried, then scan_error)
+#   contains "SCAN_HANGUP"  -> connection closed without a reply     (treated as clamd unreachable)
+#   anything else           -> "stream: OK"
+# Stop the script to see the unreachable back-off; start it again and pending photos get scanned.
+import os
+import socket
+import struct
+import sys
+import threading
+
+
+def read_exact(conn, n):
+    buf = b""
+    while len(buf) < n:
+        part = conn.recv(n - len(buf))
+        if not part:
+            return None
+        buf += part
+    return buf
+
+
+def handle(conn):
+    with conn:
+        cmd = read_exact(conn, 10)
+        if cmd != b"zINSTREAM\0":
+            conn.sendall(b"UNKNOWN COMMAND\0")
+            return
+        data = b""
+        while True:
+            head = read_exact(conn, 4)
+            if head is None:
+                return
+            (n,) = struct.unpack(">I", head)
+            if n == 0:
+                break
+            chunk = read_exact(conn, n)
+            if chunk is None:
+                return
+            data += chunk
+        if b"SCAN_HANGUP" in data:
+            reply = None
+        elif b"EICAR" in data:
+            reply = b"stream: Eicar-Test-Signature FOUND"
+        elif b"SCAN_ERROR" in data:
+            reply = b"INSTREAM size limit exceeded. ERROR"
+        else:
+            reply = b"stream: OK"
+        print("%d bytes -> %s" % (len(data), reply.decode() if reply else "(hang up)"), flush=True)
+        if reply:
+            conn.sendall(reply + b"\0")
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: fake_clamd.py <socket>")
+    path = sys.argv[1]
+    if os.path.exists(path):
+        os.unlink(path)
+    srv = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    srv.bind(path)
+    srv.listen(16)
+    print("listening on " + path, flush=True)
+    try:
+        while True:
+            conn, _ = srv.accept()
+            threading.Thread(target=handle, args=(conn,), daemon=True).start()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        os.unlink(path)
+
+
+if __name__ == "__main__":
+    main()
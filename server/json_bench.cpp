@@ -0,0 +1,110 @@
+// json_bench.cpp — /api/blocks serialization: the nlohmann DOM + dump() the handlers used to build,
+// against the streaming JsonWriter (write_blocks) they use now, on the same in-memory fixture.
+//
+//   ./json_bench [dates=10] [photos_per_date=100] [iterations=300]
+//
+// Both paths run the same queries (personal scope, ?t= token appended to every URL), so the
+// difference is the serialization. Build with cmake -DBUILD_BENCHMARKS=ON (target json_bench), or by hand:
+// g++ -O2 -std=c++17 -Iserver -Iserver/third_party server/json_bench.cpp web_assets.cpp -o json_bench \
+//     -lsqlite3 -lssl -lcrypto -largon2 -luuid -lz -pthread
+#define main server_main
+#include "main.cpp"
+#undef main
+
+// the personal /api/blocks path as it was before JsonWriter: one json object per photo, a
+// std::string per column, URL strings rebuilt to append the token, then dump()
+static std::string dom_blocks(AppContext &ctx, const std::string &owner, const std::string &until, int start, int count, const std::string &token) {
+    json out = json::array();
+    sqlite3_stmt *stmt = nullptr;
+    const char *sql_dates = "SELECT date FROM photo_date_counts WHERE scope='personal' AND owner=? AND date < ? ORDER BY date DESC LIMIT ? OFFSET ?;";
+    if (sqlite3_prepare_v2(ctx.db, sql_dates, -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, owner.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, until.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 3, count);
+        sqlite3_bind_int(stmt, 4, start);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            std::string date_s = (const char*)sqlite3_column_text(stmt, 0);
+            sqlite3_stmt *ps = nullptr;
+            const char *sql_ph = "SELECT id,owner,scope,orig_filename,thumb_path,storage_path,created_at,placeholder FROM photos WHERE date=? AND scope='personal' AND owner=? ORDER BY created_at DESC;";
+            if (sqlite3_prepare_v2(ctx.db, sql_ph, -1, &ps, NULL) != SQLITE_OK) continue;
+            sqlite3_bind_text(ps, 1, date_s.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(ps, 2, owner.c_str(), -1, SQLITE_TRANSIENT);
+            json block;
+            block["date"] = date_s;
+            block["photos"] = json::array();
+            while (sqlite3_step(ps) == SQLITE_ROW) {
+                json p;
+                p["id"] = std::string((const char*)sqlite3_column_text(ps, 0));
+                p["owner"] = std::string((const char*)sqlite3_column_text(ps, 1));
+                p["scope"] = std::string((const char*)sqlite3_column_text(ps, 2));
+                p["orig_name"] = std::string((const char*)sqlite3_column_text(ps, 3));
+                std::string id = std::string((const char*)sqlite3_column_text(ps, 0));
+                p["thumb_url"] = std::string("/thumbs/") + id;
+                p["full_url"] = std::string("/images/") + id;
+                if (!token.empty()) {
+                    p["thumb_url"] = p["thumb_url"].get<std::string>() + std::string("?t=") + token;
+                    p["full_url"] = p["full_url"].get<std::string>() + std::string("?t=") + token;
+                }
+                p["created_at"] = std::string((const char*)sqlite3_column_text(ps, 6));
+                if (sqlite3_column_type(ps, 7) != SQLITE_NULL) p["placeholder"] = std::string((const char*)sqlite3_column_text(ps, 7));
+                block["photos"].push_back(p);
+            }
+            sqlite3_finalize(ps);
+            out.push_back(block);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return out.dump();
+}
+
+static std::string writer_blocks(AppContext &ctx, const std::string &owner, const std::string &until, int start, int count, const std::string &token) {
+    std::string &buf = json_buffer();
+    JsonWriter w(buf);
+    write_blocks(ctx, w, "", owner, until, start, count, token);
+    return std::string(buf.data(), buf.size());
+}
+
+int main(int argc, char **argv) {
+    int dates = argc > 1 ? std::atoi(argv[1]) : 10;
+    int per_date = argc > 2 ? std::atoi(argv[2]) : 100;
+    int iterations = argc > 3 ? std::atoi(argv[3]) : 300;
+    if (dates <= 0 || per_date <= 0 || iterations <= 0) { std::cerr << "usage: json_bench [dates] [photos_per_date] [iterations]" << std::endl; return 2; }
+
+    AppContext ctx;
+    ctx.cfg.db_path = ":memory:";
+    if (!init_db(ctx)) { std::cerr << "cannot create the fixture database" << std::endl; return 1; }
+    const std::string owner = "alice";
+    const std::string token = make_jwt(ctx, owner);
+    // a 16px LQIP data URI is a few hundred bytes of base64
+    const std::string placeholder = "data:image/jpeg;base64," + std::string(420, 'Q');
+    sqlite3_exec(ctx.db, "BEGIN;", 0, 0, 0);
+    for (int d = 0; d < dates; ++d) {
+        char date[16];
+        std::snprintf(date, sizeof(date), "2024-%02d-%02d", 1 + d / 28 % 12, 1 + d % 28);
+        for (int i = 0; i < per_date; ++i) {
+            std::string id = gen_uuid();
+            insert_photo_record(ctx, id, owner, "personal", date, "IMG_" + std::to_string(d * per_date + i) + ".jpg",
+                                "img/" + id + ".jpg", "img/" + id + ".thumb.jpg", "", placeholder, "clean");
+        }
+    }
+    sqlite3_exec(ctx.db, "COMMIT;", 0, 0, 0);
+
+    const std::string until = "~";
+    std::string a = dom_blocks(ctx, owner, until, 0, dates, token);
+    std::string b = writer_blocks(ctx, owner, until, 0, dates, token);
+    bool same = json::parse(a) == json::parse(b); // key order differs, content must not
+
+    auto run = [&](const char *name, std::string (*fn)(AppContext &, const std::string &, const std::string &, int, int, const std::string &)) {
+        size_t bytes = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i) bytes = fn(ctx, owner, until, 0, dates, token).size();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count() / iterations;
+        std::printf("%-14s %8.3f ms/request  %zu bytes\n", name, ms, bytes);
+    };
+    std::printf("fixture: %d dates x %d photos, personal scope with ?t= token, %d iterations\n", dates, per_date, iterations);
+    run("DOM + dump():", dom_blocks);
+    run("JsonWriter:", writer_blocks);
+    std::printf("same JSON: %s\n", same ? "yes" : "NO");
+    sqlite3_close(ctx.db);
+    return same ? 0 : 1;
+}
@@ -3,8 +3,12 @@
 // Build example:
 // g++ main.cpp -o local-photo-server -std=c++17 -lssl -lcrypto -lsqlite3 -largon2 -luuid -pthread
 
+#define CPPHTTPLIB_OPENSSL_SUPPORT // SSLServer for the optional HTTPS mode (tls_cert / tls_key)
+// POST /api/export: up to kExportMaxIds ids of ~39 bytes each once "," is sent as %2C, plus the token (default 8 KB)
+#define CPPHTTPLIB_FORM_URL_ENCODED_PAYLOAD_MAX_LENGTH (256 * 1024)
 #include <httplib.h>
 #include <nlohmann/json.hpp>
+#include "web_assets.h"
 
 #include <sqlite3.h>
 #include <argon2.h>
@@ -12,9 +16,24 @@
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/buffer.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 #include <uuid/uuid.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
 
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <dirent.h>
 #include <unistd.h>
 #include <fstream>
 #include <iostream>
@@ -25,11 +44,23 @@
 #include <cstdio>
 #include <vector>
 #include <map>
+#include <set>
 #include <algorithm>
 #include <memory>
 #include <cerrno>
 #include <string>
+#include <string_view>
 #include <cctype>
+#include <limits>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <cstdlib>
 #include <ctime> 
@@ -47,13 +78,274 @@ struct Config {
     int thumb_size = 300;
     bool allow_anonymous_shared = false;
     bool disable_clamav = false;
+    std::string clamd_socket = "/var/run/clamav/clamd.ctl"; // clamd LocalSocket (INSTREAM protocol)
+    int scan_workers = 2;
+    int scan_retry_seconds = 30;      // delay before a failed scan is retried
+    int scan_max_attempts = 3;        // clamd ERROR replies before a photo is marked scan_error (unreachable retries forever)
+    int reclaim_per_second = 200;     // background unlinks after deletes
+    int duplicate_distance = 6;       // max differing dHash bits for two photos to count as near-duplicates (0..11)
+    int change_log_keep = 100000;     // newest change-log rows kept; older /api/changes cursors get 410
+    int max_event_streams = 32;       // concurrent /api/events connections (one per visible tab); each pins a server thread while open
+    int http_threads = 64;            // server thread pool, raised to max_event_streams + 8 if smaller
+    int compression_level = 6;        // gzip 1..9 (brotli quality uses the same value)
+    int compression_min_bytes = 1024; // smaller responses are sent as-is
+    std::string web_dir = "";         // serve web files from this folder instead of the embedded copy (development)
+    std::string tls_cert = "";        // PEM certificate chain; with tls_key set the server speaks HTTPS only
+    std::string tls_key = "";
+    int tls_session_cache = 20480;    // server-side TLS session cache entries (0 disables)
+    int tls_session_timeout = 86400;  // seconds a cached session or ticket can be resumed
+    bool tls_session_tickets = true;  // stateless resumption; ticket keys live as long as the process
+    bool tls_ktls = true;             // hand record encryption to the kernel when it supports kTLS
+    int keep_alive_timeout = 5;       // seconds an idle connection is kept (each holds a server thread)
+    int keep_alive_max_requests = 100;
+    int trace_slots = 4096;           // recent requests kept with phase timings for /debug/slow (0 disables)
+    bool debug_endpoints = false;     // /debug/slow, /debug/warmup and keyless /api/replication/status from localhost
+    int warmup_dates = 8;             // newest dates per scope/owner whose thumbnails are pre-read at startup (0 disables)
+    int warmup_mb_per_second = 32;    // read budget for that, on top of idle I/O priority
+    std::string replication_key = ""; // shared secret for /api/replication/* (empty: replication endpoints off)
+    std::string replica_of = "";      // primary base URL; when set this server is a read-only follower
+    std::vector<std::string> thumb_formats = { "avif", "webp" }; // extra thumbnail encodings, preferred first
 };
 
+// photo ids waiting for a background worker (see transcode_worker, scan_worker)
+struct WorkQueue {
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<std::string> ids;
+    std::multimap<std::chrono::steady_clock::time_point, std::string> later;  // queue_push_later, by due time
+    std::unordered_map<std::string, int> failures;                             // scan_worker: ERROR replies per id
+};
+static void queue_push(WorkQueue &q, const std::string &id) {
+    {
+        std::lock_guard<std::mutex> lk(q.m);
+        q.ids.push_back(id);
+    }
+    q.cv.notify_one();
+}
+// re-queue after a delay without holding the worker that gave up on it
+static void queue_push_later(WorkQueue &q, const std::string &id, int seconds) {
+    {
+        std::lock_guard<std::mutex> lk(q.m);
+        q.later.emplace(std::chrono::steady_clock::now() + std::chrono::seconds(seconds), id);
+    }
+    q.cv.notify_one();
+}
+// waits until ids has something, moving delayed items over as they fall due
+static void queue_wait(WorkQueue &q, std::unique_lock<std::mutex> &lk) {
+    for (;;) {
+        auto now = std::chrono::steady_clock::now();
+        while (!q.later.empty() && q.later.begin()->first <= now) {
+            q.ids.push_back(std::move(q.later.begin()->second));
+            q.later.erase(q.later.begin());
+        }
+        if (!q.ids.empty()) return;
+        if (q.later.empty()) q.cv.wait(lk);
+        else q.cv.wait_until(lk, q.later.begin()->first);
+    }
+}
+static std::string queue_pop(WorkQueue &q) {
+    std::unique_lock<std::mutex> lk(q.m);
+    queue_wait(q, lk);
+    std::string id = std::move(q.ids.front());
+    q.ids.pop_front();
+    return id;
+}
+// blocks for the first item, then takes whatever else is queued (up to max)
+static std::vector<std::string> queue_pop_some(WorkQueue &q, size_t max) {
+    std::unique_lock<std::mutex> lk(q.m);
+    queue_wait(q, lk);
+    std::vector<std::string> out;
+    while (!q.ids.empty() && out.size() < max) {
+        out.push_back(std::move(q.ids.front()));
+        q.ids.pop_front();
+    }
+    return out;
+}
+
+// version counter bumped after every write to photos; /api/events streams sleep on it
+struct ChangeFeed {
+    std::mutex m;
+    std::condition_variable cv;
+    uint64_t version = 0;
+    std::atomic<int> streams{0};
+};
+
+// --- per-request phase timings, kept in a fixed ring for /debug/slow ---
+// A request runs on one server thread from pre-routing to post-routing, so the trace being filled
+// is thread-local. PhaseTimer does nothing outside a request (background workers) or inside another
+// phase: the outermost phase gets the time. Streaming endpoints serialize while stepping the
+// statement, so for them "db" includes building the JSON.
+enum TracePhase { kPhaseAuth, kPhaseDb, kPhaseFileIo, kPhaseThumbnail, kPhaseSerialize, kPhaseCount };
+static const char *const kPhaseNames[kPhaseCount] = { "auth", "db", "file_io", "thumbnail", "serialize" };
+static const uint32_t kTraceSpans = 16;
+struct TraceRecord {
+    uint64_t start_us;                // wall clock, microseconds since the epoch
+    uint32_t total_us, status, tid, span_count;
+    uint32_t phase_us[kPhaseCount];
+    uint32_t reserved;
+    uint64_t spans[kTraceSpans];      // phase:3 | offset_us:30 | duration_us:31, first kTraceSpans only
+    char what[72];                    // "GET /api/blocks", no query string (it can carry ?t= tokens)
+};
+static_assert(sizeof(TraceRecord) % 8 == 0, "TraceRecord is copied as 64-bit words");
+// Fixed-size ring, written without locks: each slot is a seqlock (odd while being written) and
+// readers drop slots that changed under them.
+class TraceRing {
+public:
+    explicit TraceRing(size_t n) : slots_(n) {}
+    void push(const TraceRecord &r) {
+        uint64_t words[kWords];
+        std::memcpy(words, &r, sizeof(r));
+        uint64_t n = head_.fetch_add(1, std::memory_order_relaxed);
+        Slot &s = slots_[n % slots_.size()];
+        s.seq.store(2 * n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < kWords; ++i) s.w[i].store(words[i], std::memory_order_relaxed);
+        s.seq.store(2 * n + 2, std::memory_order_release);
+    }
+    std::vector<TraceRecord> snapshot() const {
+        std::vector<TraceRecord> out;
+        out.reserve(slots_.size());
+        uint64_t words[kWords];
+        for (const Slot &s : slots_) {
+            uint64_t before = s.seq.load(std::memory_order_acquire);
+            if (before == 0 || (before & 1)) continue;
+            for (size_t i = 0; i < kWords; ++i) words[i] = s.w[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.seq.load(std::memory_order_relaxed) != before) continue;
+            out.emplace_back();
+            std::memcpy(&out.back(), words, sizeof(words));
+        }
+        return out;
+    }
+    uint64_t recorded() const { return head_.load(std::memory_order_relaxed); }
+    size_t size() const { return slots_.size(); }
+private:
+    static constexpr size_t kWords = sizeof(TraceRecord) / 8;
+    struct Slot {
+        std::atomic<uint64_t> seq{0};
+        std::atomic<uint64_t> w[kWords];
+    };
+    std::vector<Slot> slots_;
+    std::atomic<uint64_t> head_{0};
+};
+struct ActiveTrace {
+    bool on = false, in_phase = false;
+    std::chrono::steady_clock::time_point start;
+    TraceRecord rec;
+};
+static ActiveTrace &active_trace() {
+    thread_local ActiveTrace t;
+    return t;
+}
+static uint64_t elapsed_us(std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b) {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(b - a).count();
+}
+class PhaseTimer {
+public:
+    explicit PhaseTimer(TracePhase phase) : phase_(phase) {
+        ActiveTrace &t = active_trace();
+        if (!t.on || t.in_phase) return;
+        t.in_phase = armed_ = true;
+        start_ = std::chrono::steady_clock::now();
+    }
+    ~PhaseTimer() {
+        if (!armed_) return;
+        ActiveTrace &t = active_trace();
+        uint64_t dur = elapsed_us(start_, std::chrono::steady_clock::now());
+        uint64_t off = elapsed_us(t.start, start_);
+        t.rec.phase_us[phase_] += (uint32_t)std::min<uint64_t>(dur, UINT32_MAX - t.rec.phase_us[phase_]);
+        if (t.rec.span_count < kTraceSpans)
+            t.rec.spans[t.rec.span_count] = (uint64_t)phase_ << 61 | std::min<uint64_t>(off, (1u << 30) - 1) << 31 |
+                                            std::min<uint64_t>(dur, (1u << 31) - 1);
+        ++t.rec.span_count;               // counts past kTraceSpans so dropped spans can be reported
+        t.in_phase = false;
+    }
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+private:
+    TracePhase phase_;
+    bool armed_ = false;
+    std::chrono::steady_clock::time_point start_;
+};
+static void trace_begin(const Request &req) {
+    ActiveTrace &t = active_trace();
+    t.on = req.path.rfind("/debug/", 0) != 0; // reading the ring should not show up in it
+    if (!t.on) return;
+    t.in_phase = false;
+    t.start = std::chrono::steady_clock::now();
+    t.rec = TraceRecord();
+    t.rec.start_us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    t.rec.tid = (uint32_t)syscall(SYS_gettid);
+    std::snprintf(t.rec.what, sizeof(t.rec.what), "%s %s", req.method.c_str(), req.path.c_str());
+}
+static void trace_end(TraceRing &ring, const Response &res) {
+    ActiveTrace &t = active_trace();
+    if (!t.on) return;
+    t.on = false;
+    // an event stream "takes" as long as the client stays connected
+    if (res.get_header_value("Content-Type") == "text/event-stream") return;
+    t.rec.total_us = (uint32_t)std::min<uint64_t>(elapsed_us(t.start, std::chrono::steady_clock::now()), UINT32_MAX);
+    t.rec.status = (uint32_t)res.status;
+    ring.push(t.rec);
+}
+
+// progress of the startup page-cache warmup (see warmup_worker, /debug/warmup)
+struct Warmup {
+    std::atomic<int> state{0};                  // 0 waiting, 1 running, 2 done
+    std::atomic<uint64_t> dates{0}, photos{0};
+    std::atomic<uint64_t> bytes{0}, bytes_done{0}; // planned thumbnail and metadata bytes / bytes checked so far
+    std::atomic<uint64_t> bytes_resident{0};    // already in the page cache when checked
+    std::atomic<uint64_t> bytes_read{0};        // read ahead from disk
+    std::atomic<long long> started_ms{0}, finished_ms{0};
+    // thumbnails requested since startup (/thumbs and each /api/thumbs entry), and how many of those were in the warmed set
+    std::atomic<uint64_t> thumb_requests{0}, warm_hits{0};
+    std::unique_ptr<std::unordered_set<std::string>> owned_ids;
+    std::atomic<const std::unordered_set<std::string>*> ids{nullptr}; // set once planned, never replaced
+    void note_thumb(const std::string &id) {
+        thumb_requests.fetch_add(1, std::memory_order_relaxed);
+        const auto *set = ids.load(std::memory_order_acquire);
+        if (set && set->count(id)) warm_hits.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+// follower progress (see replica_worker, /api/replication/status); seqs are the primary's change log
+struct ReplicaState {
+    std::atomic<int> state{0};                  // 0 starting, 1 snapshot, 2 streaming, 3 error
+    std::atomic<long long> applied_seq{0};      // primary changes applied up to here
+    std::atomic<long long> primary_seq{0};      // newest primary seq seen
+    std::atomic<long long> caught_up_ms{0};     // wall clock of the last time applied_seq reached primary_seq
+    std::atomic<uint64_t> photos_applied{0}, files_fetched{0}, bytes_fetched{0};
+    std::mutex m;
+    std::string last_error;                     // guarded by m
+};
+
+class ThumbPack;
+class PhashIndex;
 struct AppContext {
     Config cfg;
     sqlite3* db = nullptr;
+    std::shared_ptr<WorkQueue> transcode;
+    std::shared_ptr<WorkQueue> scan;   // null when disable_clamav
+    std::shared_ptr<ThumbPack> thumbs; // null if storage_root/packs cannot be opened (files only)
+    std::shared_ptr<WorkQueue> reclaim; // file paths to unlink (see reclaim_worker)
+    std::shared_ptr<ChangeFeed> changes;
+    std::shared_ptr<PhashIndex> phashes; // near-duplicate lookup (see /api/duplicates)
+    std::shared_ptr<TraceRing> traces;   // null when trace_slots is 0
+    std::shared_ptr<Warmup> warmup;      // null when warmup_dates is 0
+    std::shared_ptr<ReplicaState> replica; // null unless replica_of is set
 };
 
+// the rows themselves are logged by triggers (see init_change_log); this only wakes listeners
+static void notify_changes(AppContext &ctx) {
+    if (!ctx.changes) return;
+    {
+        std::lock_guard<std::mutex> lk(ctx.changes->m);
+        ++ctx.changes->version;
+    }
+    ctx.changes->cv.notify_all();
+}
+
 static std::string now_iso() {
     auto now = std::chrono::system_clock::now();
     std::time_t tt = std::chrono::system_clock::to_time_t(now);
@@ -108,6 +400,7 @@ static std::string file_extension(const std::string &name) {
     return name.substr(pos+1);
 }
 static std::string read_file_binary(const std::string &path) {
+    PhaseTimer timer(kPhaseFileIo);
     std::ifstream ifs(path, std::ios::binary);
     if (!ifs) return {};
     ifs.seekg(0, std::ios::end);
@@ -119,6 +412,7 @@ static std::string read_file_binary(const std::string &path) {
     return out;
 }
 static bool write_file_binary(const std::string &path, const std::string &data) {
+    PhaseTimer timer(kPhaseFileIo);
     std::ofstream ofs(path, std::ios::binary);
     if (!ofs) return false;
     ofs.write(data.data(), (std::streamsize)data.size());
@@ -152,28 +446,408 @@ static std::string base64_decode_std(const std::string &in) {
     if (decoded <= 0) return {};
     return std::string(out.data(), decoded);
 }
-static std::string guess_mime_from_path(const std::string &path) {
-    auto pos = path.find_last_of('.');
-    if (pos == std::string::npos) return "image/jpeg";
-    std::string ext = path.substr(pos + 1);
+static std::string base64_encode_std(const std::string &input) {
+    BIO *b64 = BIO_new(BIO_f_base64());
+    BIO *bmem = BIO_new(BIO_s_mem());
+    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+    b64 = BIO_push(b64, bmem);
+    BIO_write(b64, input.data(), (int)input.size());
+    BIO_flush(b64);
+    BUF_MEM *bptr;
+    BIO_get_mem_ptr(b64, &bptr);
+    std::string out(bptr->data, bptr->length);
+    BIO_free_all(b64);
+    return out;
+}
+// content types by lowercase file extension: originals, thumbnail variants and web assets
+static const std::map<std::string, std::string> &content_types() {
+    static const std::map<std::string, std::string> types = {
+        { "jpg", "image/jpeg" }, { "jpeg", "image/jpeg" }, { "jpe", "image/jpeg" },
+        { "png", "image/png" }, { "gif", "image/gif" }, { "webp", "image/webp" },
+        { "avif", "image/avif" }, { "heic", "image/heic" }, { "heif", "image/heif" },
+        { "bmp", "image/bmp" }, { "tif", "image/tiff" }, { "tiff", "image/tiff" },
+        { "svg", "image/svg+xml" }, { "ico", "image/x-icon" },
+        { "html", "text/html; charset=utf-8" }, { "htm", "text/html; charset=utf-8" },
+        { "css", "text/css; charset=utf-8" }, { "js", "application/javascript; charset=utf-8" },
+        { "json", "application/json" }, { "txt", "text/plain; charset=utf-8" },
+        { "woff", "font/woff" }, { "woff2", "font/woff2" },
+    };
+    return types;
+}
+static std::string content_type_for(const std::string &path) {
+    std::string ext = file_extension(path);
     for (auto &c : ext) c = tolower(c);
-    if (ext == "jpg" || ext == "jpeg") return "image/jpeg";
-    if (ext == "png") return "image/png";
-    if (ext == "gif") return "image/gif";
-    if (ext == "webp") return "image/webp";
-    if (ext == "bmp") return "image/bmp";
-    if (ext == "svg") return "image/svg+xml";
-    if (ext == "tiff" || ext == "tif") return "image/tiff";
-    return "application/octet-stream";
+    auto it = content_types().find(ext);
+    return it != content_types().end() ? it->second : "application/octet-stream";
+}
+// uploads keep whatever extension the client sent (or none); fall back to the magic bytes
+static std::string image_content_type(const std::string &path, const std::string &data) {
+    std::string ct = content_type_for(path);
+    if (ct != "application/octet-stream") return ct;
+    auto starts = [&](size_t off, const char *magic) { return data.compare(off, std::strlen(magic), magic) == 0; };
+    if (starts(0, "\xff\xd8\xff")) return "image/jpeg";
+    if (starts(0, "\x89PNG")) return "image/png";
+    if (starts(0, "GIF8")) return "image/gif";
+    if (starts(0, "RIFF") && starts(8, "WEBP")) return "image/webp";
+    if (starts(4, "ftypavif")) return "image/avif";
+    if (starts(4, "ftypheic") || starts(4, "ftypmif1")) return "image/heic";
+    if (starts(0, "BM")) return "image/bmp";
+    return ct;
 }
 // create thumbnail using ImageMagick `convert`
 static bool create_thumbnail(const std::string &src, const std::string &dst, int size) {
+    PhaseTimer timer(kPhaseThumbnail);
     if (size <= 0) return false;
     std::ostringstream cmd;
     cmd << "convert " << "'" << src << "' -auto-orient -resize 'x" << size << "' -strip -quality 85 " << "'" << dst << "'";
     int r = system(cmd.str().c_str());
     return (r == 0);
 }
+// thumbnail encodings besides the baseline JPEG; stored next to it as <id>.thumb.<ext>
+struct ThumbFormat { const char *ext; const char *mime; int quality; };
+static const ThumbFormat kThumbFormats[] = {
+    { "avif", "image/avif", 50 },
+    { "webp", "image/webp", 80 },
+};
+static const ThumbFormat *find_thumb_format(const std::string &ext) {
+    for (const auto &f : kThumbFormats) if (ext == f.ext) return &f;
+    return nullptr;
+}
+static std::string thumb_variant_path(const std::string &thumb_path, const char *ext) {
+    auto dot = thumb_path.find_last_of('.');
+    if (dot == std::string::npos || thumb_path.find('/', dot) != std::string::npos) return thumb_path + "." + ext;
+    return thumb_path.substr(0, dot + 1) + ext;
+}
+// encode one variant from the original (not the JPEG thumbnail, to avoid a second generation loss);
+// written to a temp name and renamed so a half-written file is never served. Runs niced: it is
+// only called from the background encoder.
+static bool create_thumbnail_variant(const std::string &src, const std::string &dst, int size, const ThumbFormat &fmt) {
+    PhaseTimer timer(kPhaseThumbnail);
+    if (size <= 0) return false;
+    std::string tmp = dst + ".tmp";
+    std::ostringstream cmd;
+    cmd << "nice -n 10 convert " << "'" << src << "' -auto-orient -resize 'x" << size << "' -strip -quality " << fmt.quality
+        << " " << fmt.ext << ":'" << tmp << "' 2>/dev/null";
+    if (system(cmd.str().c_str()) != 0 || rename(tmp.c_str(), dst.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    chmod(dst.c_str(), 0640);
+    return true;
+}
+static void put_be(std::string &out, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; --i) out.push_back((char)((v >> (i * 8)) & 0xff));
+}
+static void put_le(std::string &out, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) out.push_back((char)((v >> (i * 8)) & 0xff));
+}
+
+// --- thumbnail packs: append-only segments under storage_root/packs (Haystack-style) ---
+// Thumbnails are stored as records in large segment files instead of one small file each; an
+// in-memory index maps "<id>.<ext>" to (segment, offset, length), so serving one is a single
+// pread on an already-open descriptor. The index is rebuilt at startup from the record headers.
+// Record: "TPK1" | u8 type (0 data, 1 tombstone) | u16 key_len | u32 data_len | u32 crc32 | key | data
+// Later records win; deletes append a tombstone; compact() rewrites mostly-dead segments.
+struct PackSegment {
+    uint32_t no = 0;
+    std::string path;
+    int fd = -1;
+    uint64_t size = 0;   // bytes of whole records (guarded by ThumbPack::m_)
+    uint64_t dead = 0;   // bytes of overwritten/deleted records and tombstones
+    ~PackSegment() { if (fd >= 0) close(fd); }
+};
+struct PackLoc {
+    uint32_t segment = 0;
+    uint32_t length = 0;
+    uint64_t offset = 0;  // of the data, not the record
+    uint32_t crc = 0;
+};
+static std::string thumb_key(const std::string &id, const char *ext) { return id + "." + ext; }
+class ThumbPack {
+public:
+    static const uint64_t kSegmentMax = 256ull << 20;
+    static const size_t kCompactBatch = 1 << 20;    // bytes copied per exclusive lock during compaction
+
+    bool open(const std::string &dir) {
+        dir_ = dir;
+        if (!ensure_dir(dir_)) return false;
+        std::vector<uint32_t> nos;
+        if (DIR *d = opendir(dir_.c_str())) {
+            while (struct dirent *e = readdir(d)) {
+                unsigned no = 0;
+                char tail[8] = {};
+                if (std::sscanf(e->d_name, "thumbs-%06u.%7s", &no, tail) == 2 && std::strcmp(tail, "pack") == 0) nos.push_back(no);
+            }
+            closedir(d);
+        }
+        std::sort(nos.begin(), nos.end());
+        std::unique_lock<std::shared_mutex> lk(m_);
+        for (uint32_t no : nos) {
+            auto seg = std::make_shared<PackSegment>();
+            seg->no = no;
+            seg->path = segment_path(no);
+            seg->fd = ::open(seg->path.c_str(), O_RDWR | O_CLOEXEC);
+            segments_[no] = seg;   // before the scan, so dead bytes within it are accounted
+            if (seg->fd < 0 || !scan_segment(*seg)) return false;
+        }
+        return segments_.empty() ? add_segment() != nullptr : true;
+    }
+    bool put(const std::string &key, const std::string &data) {
+        PhaseTimer timer(kPhaseFileIo);
+        std::unique_lock<std::shared_mutex> lk(m_);
+        PackLoc loc;
+        if (!append_record(0, key, data, loc)) return false;
+        drop_entry(key);
+        index_[key] = loc;
+        return true;
+    }
+    // reads the file and moves it into the pack (the file is removed once stored)
+    bool put_file(const std::string &key, const std::string &path) {
+        std::string data = read_file_binary(path);
+        if (data.empty() || !put(key, data)) return false;
+        unlink(path.c_str());
+        return true;
+    }
+    bool find(const std::string &key, PackLoc &loc) const {
+        std::shared_lock<std::shared_mutex> lk(m_);
+        auto it = index_.find(key);
+        if (it == index_.end()) return false;
+        loc = it->second;
+        return true;
+    }
+    // one pread; the segment stays open while in use even if compaction retires it meanwhile.
+    // When compaction retired it before this got hold of it, the record has moved: look `key` up again.
+    bool read(const std::string &key, PackLoc loc, std::string &out) const {
+        PhaseTimer timer(kPhaseFileIo);
+        std::shared_ptr<PackSegment> seg;
+        for (int attempt = 0; !seg; ++attempt) {
+            std::shared_lock<std::shared_mutex> lk(m_);
+            auto it = segments_.find(loc.segment);
+            if (it != segments_.end()) { seg = it->second; break; }
+            auto moved = index_.find(key);
+            if (attempt == 3 || moved == index_.end()) return false;
+            loc = moved->second;
+        }
+        out.resize(loc.length);
+        return pread(seg->fd, &out[0], loc.length, (off_t)loc.offset) == (ssize_t)loc.length;
+    }
+    void remove(const std::string &key) {
+        std::unique_lock<std::shared_mutex> lk(m_);
+        if (index_.find(key) == index_.end()) return;
+        PackLoc loc;
+        if (!append_record(1, key, std::string(), loc)) return;
+        segments_.rbegin()->second->dead += header_size(key);
+        drop_entry(key);
+    }
+    // rewrites every non-active segment whose dead share is at least `min_dead_ratio`: live records
+    // are appended to the active segment and the old file is unlinked. `seal_active` first starts a
+    // new segment so the current one can be compacted too (offline --compact-thumbs). Returns bytes reclaimed.
+    // Records are read without the lock; m_ is only held exclusively to append a batch of them and
+    // repoint their index entries, and only entries still pointing at the old copy are moved, so
+    // puts and removes that happen meanwhile win. The copies are synced before the old file goes.
+    uint64_t compact(double min_dead_ratio, bool seal_active = false) {
+        std::lock_guard<std::mutex> one(compact_m_);
+        uint64_t reclaimed = 0;
+        std::vector<std::shared_ptr<PackSegment>> victims;
+        {
+            std::unique_lock<std::shared_mutex> lk(m_);
+            if (seal_active && segments_.rbegin()->second->dead > 0 && !add_segment()) return 0;
+            for (auto &kv : segments_) {
+                const PackSegment &s = *kv.second;
+                if (kv.first != segments_.rbegin()->first && s.size > 0 && s.dead > 0 && (double)s.dead >= min_dead_ratio * (double)s.size)
+                    victims.push_back(kv.second);
+            }
+        }
+        for (const auto &seg : victims) {
+            struct Copy { uint8_t type; std::string key; uint64_t off; std::string data; };
+            std::vector<Copy> batch;
+            size_t batch_bytes = 0;
+            std::set<uint32_t> written;
+            bool ok = true;
+            // appends the batch where the index still points at the old copy (tombstones: where the key is still absent)
+            auto flush = [&] {
+                std::unique_lock<std::shared_mutex> lk(m_);
+                bool older_exists = segments_.begin()->first < seg->no;
+                for (auto &c : batch) {
+                    PackLoc out;
+                    auto it = index_.find(c.key);
+                    if (c.type == 1) {
+                        // a tombstone may still hide a record in an older segment: carry it forward
+                        if (!older_exists || it != index_.end()) continue;
+                        if (!append_record(1, c.key, std::string(), out)) return false;
+                    } else {
+                        if (it == index_.end() || it->second.segment != seg->no || it->second.offset != c.off) continue;
+                        if (!append_record(0, c.key, c.data, out)) return false;
+                        it->second = out;
+                    }
+                    written.insert(out.segment);
+                }
+                batch.clear();
+                batch_bytes = 0;
+                return true;
+            };
+            walk_segment(*seg, [&](uint8_t type, const std::string &key, uint64_t data_off, uint32_t len, uint32_t) {
+                Copy c{ type, key, data_off, std::string() };
+                if (type == 0) {
+                    PackLoc loc;
+                    if (!find(key, loc) || loc.segment != seg->no || loc.offset != data_off) return true;
+                    c.data.resize(len);
+                    if (pread(seg->fd, &c.data[0], len, (off_t)data_off) != (ssize_t)len) return ok = false;
+                }
+                batch_bytes += c.key.size() + c.data.size();
+                batch.push_back(std::move(c));
+                if (batch_bytes >= kCompactBatch) ok = flush();
+                return ok;
+            });
+            if (ok) ok = flush();
+            // the copies must be on disk before the only other copy is unlinked
+            for (uint32_t no : written) {
+                auto dst = segment(no);
+                if (dst && fdatasync(dst->fd) != 0) ok = false;
+            }
+            if (!ok) break;
+            std::unique_lock<std::shared_mutex> lk(m_);
+            reclaimed += seg->dead;
+            segments_.erase(seg->no);
+            unlink(seg->path.c_str());
+        }
+        return reclaimed;
+    }
+    size_t entries() const { std::shared_lock<std::shared_mutex> lk(m_); return index_.size(); }
+    // for readahead: keeps the segment open even if compaction retires it meanwhile
+    std::shared_ptr<PackSegment> segment(uint32_t no) const {
+        std::shared_lock<std::shared_mutex> lk(m_);
+        auto it = segments_.find(no);
+        return it == segments_.end() ? nullptr : it->second;
+    }
+
+private:
+    std::string segment_path(uint32_t no) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/thumbs-%06u.pack", no);
+        return dir_ + name;
+    }
+    static uint64_t header_size(const std::string &key) { return 15 + key.size(); }
+    std::shared_ptr<PackSegment> add_segment() {
+        auto seg = std::make_shared<PackSegment>();
+        seg->no = segments_.empty() ? 1 : segments_.rbegin()->first + 1;
+        seg->path = segment_path(seg->no);
+        seg->fd = ::open(seg->path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+        if (seg->fd < 0) return nullptr;
+        segments_[seg->no] = seg;
+        return seg;
+    }
+    // caller holds m_ exclusively
+    bool append_record(uint8_t type, const std::string &key, const std::string &data, PackLoc &loc) {
+        if (key.size() > 0xffff || data.size() > 0xffffffffu) return false;
+        auto seg = segments_.rbegin()->second;
+        if (seg->size > 0 && seg->size + header_size(key) + data.size() > kSegmentMax) {
+            seg = add_segment();
+            if (!seg) return false;
+        }
+        uint32_t crc = (uint32_t)crc32(0L, (const Bytef*)data.data(), (uInt)data.size());
+        std::string rec = "TPK1";
+        rec.push_back((char)type);
+        put_be(rec, key.size(), 2);
+        put_be(rec, data.size(), 4);
+        put_be(rec, crc, 4);
+        rec += key;
+        rec += data;
+        if (pwrite(seg->fd, rec.data(), rec.size(), (off_t)seg->size) != (ssize_t)rec.size()) {
+            // keep the segment append-only: a partial tail is cut off by the next startup scan
+            return false;
+        }
+        loc.segment = seg->no;
+        loc.offset = seg->size + header_size(key);
+        loc.length = (uint32_t)data.size();
+        loc.crc = crc;
+        seg->size += rec.size();
+        return true;
+    }
+    void drop_entry(const std::string &key) {
+        auto it = index_.find(key);
+        if (it == index_.end()) return;
+        auto seg = segments_.find(it->second.segment);
+        if (seg != segments_.end()) seg->second->dead += header_size(key) + it->second.length;
+        index_.erase(it);
+    }
+    // calls fn(type, key, data_offset, data_len, crc) for each complete record; false from fn stops
+    template <typename Fn>
+    bool walk_segment(PackSegment &seg, Fn fn) const {
+        struct stat st;
+        if (fstat(seg.fd, &st) != 0) return false;
+        uint64_t end = (uint64_t)st.st_size, off = 0;
+        unsigned char h[15];
+        while (off + sizeof(h) <= end) {
+            if (pread(seg.fd, h, sizeof(h), (off_t)off) != (ssize_t)sizeof(h) || std::memcmp(h, "TPK1", 4) != 0) break;
+            uint32_t key_len = (h[5] << 8) | h[6];
+            uint32_t len = ((uint32_t)h[7] << 24) | (h[8] << 16) | (h[9] << 8) | h[10];
+            uint32_t crc = ((uint32_t)h[11] << 24) | (h[12] << 16) | (h[13] << 8) | h[14];
+            if (off + sizeof(h) + key_len + len > end) break;
+            std::string key(key_len, '\0');
+            if (pread(seg.fd, &key[0], key_len, (off_t)(off + sizeof(h))) != (ssize_t)key_len) break;
+            if (!fn(h[4], key, off + sizeof(h) + key_len, len, crc)) return false;
+            off += sizeof(h) + key_len + len;
+        }
+        seg.size = off;
+        return true;
+    }
+    // startup: replay one segment into the index; a torn tail from a crash is truncated
+    bool scan_segment(PackSegment &seg) {
+        if (!walk_segment(seg, [&](uint8_t type, const std::string &key, uint64_t data_off, uint32_t len, uint32_t crc) {
+            drop_entry(key);
+            if (type == 1) seg.dead += header_size(key);
+            else index_[key] = PackLoc{ seg.no, len, data_off, crc };
+            return true;
+        })) return false;
+        struct stat st;
+        if (fstat(seg.fd, &st) == 0 && (uint64_t)st.st_size > seg.size) {
+            std::cerr << "Thumbnail pack " << seg.path << ": truncating " << (st.st_size - seg.size) << " trailing bytes" << std::endl;
+            if (ftruncate(seg.fd, (off_t)seg.size) != 0) return false;
+        }
+        return true;
+    }
+
+    std::string dir_;
+    mutable std::shared_mutex m_;   // index_ and segments_; appends take it exclusively
+    std::mutex compact_m_;          // one compaction at a time (it walks victims without m_)
+    std::unordered_map<std::string, PackLoc> index_;
+    std::map<uint32_t, std::shared_ptr<PackSegment>> segments_;
+};
+// run a command and capture its stdout (binary-safe)
+static bool run_capture(const std::string &cmd, std::string &out) {
+    FILE *p = popen(cmd.c_str(), "r");
+    if (!p) return false;
+    char buf[4096];
+    size_t n;
+    out.clear();
+    while ((n = fread(buf, 1, sizeof(buf), p)) > 0) out.append(buf, n);
+    return pclose(p) == 0;
+}
+// low-quality image placeholder: a tiny blurred JPEG (~16px on the long side, keeps aspect ratio)
+// returned as a data: URI so the grid can paint from the /api/blocks JSON alone
+static std::string create_placeholder(const std::string &thumb) {
+    PhaseTimer timer(kPhaseThumbnail);
+    std::ostringstream cmd;
+    cmd << "convert " << "'" << thumb << "' -resize '16x16' -strip -sampling-factor 4:2:0 -quality 40 jpg:- 2>/dev/null";
+    std::string data;
+    if (!run_capture(cmd.str(), data) || data.empty()) return {};
+    return "data:image/jpeg;base64," + base64_encode_std(data);
+}
+// 64-bit difference hash: grayscale 9x8 downscale, one bit per horizontally adjacent pixel pair
+// (left brighter than right). Survives re-encoding and resizing; near-identical images differ in few bits.
+static bool compute_dhash(const std::string &image, uint64_t &out) {
+    PhaseTimer timer(kPhaseThumbnail);
+    std::ostringstream cmd;
+    cmd << "nice -n 10 convert '" << image << "' -auto-orient -colorspace Gray -resize '9x8!' -depth 8 gray:- 2>/dev/null";
+    std::string px;
+    if (!run_capture(cmd.str(), px) || px.size() != 72) return false;
+    out = 0;
+    for (int r = 0; r < 8; ++r)
+        for (int c = 0; c < 8; ++c)
+            out = (out << 1) | (uint64_t)((unsigned char)px[r * 9 + c] > (unsigned char)px[r * 9 + c + 1]);
+    return true;
+}
 
 // parse multipart (extracts first file part)
 static bool parse_multipart_file(const Request &req,
@@ -263,8 +937,154 @@ static bool parse_multipart_file(const Request &req,
 }
 
 // DB helpers
+static bool table_exists(AppContext &ctx, const char *name) {
+    sqlite3_stmt *stmt = nullptr;
+    const char *sql = "SELECT 1 FROM sqlite_master WHERE name=? LIMIT 1;";
+    if (sqlite3_prepare_v2(ctx.db, sql, -1, &stmt, NULL) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_TRANSIENT);
+    bool found = (sqlite3_step(stmt) == SQLITE_ROW);
+    sqlite3_finalize(stmt);
+    return found;
+}
+// add a column to an existing table (databases created before the column existed)
+static bool ensure_column(AppContext &ctx, const char *table, const char *column, const char *decl) {
+    sqlite3_stmt *stmt = nullptr;
+    std::string pragma = std::string("PRAGMA table_info(") + table + ");";
+    if (sqlite3_prepare_v2(ctx.db, pragma.c_str(), -1, &stmt, NULL) != SQLITE_OK) return false;
+    bool found = false;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (std::string((const char*)sqlite3_column_text(stmt, 1)) == column) { found = true; break; }
+    }
+    sqlite3_finalize(stmt);
+    if (found) return true;
+    std::string sql = std::string("ALTER TABLE ") + table + " ADD COLUMN " + column + " " + decl + ";";
+    char *err = nullptr;
+    if (sqlite3_exec(ctx.db, sql.c_str(), 0, 0, &err) != SQLITE_OK) {
+        std::cerr << "DB migration error (" << table << "." << column << "): " << (err ? err : "") << std::endl;
+        if (err) sqlite3_free(err);
+        return false;
+    }
+    return true;
+}
+// full-text index over orig_filename/owner, kept in sync with photos by triggers
+// (external content table: the text itself is stored only once, in photos)
+static bool init_search_index(AppContext &ctx) {
+    bool existed = table_exists(ctx, "photos_fts");
+    const char *sql = R"SQL(
+    CREATE VIRTUAL TABLE IF NOT EXISTS photos_fts USING fts5(
+      orig_filename, owner,
+      content='photos', content_rowid='rowid',
+      tokenize='unicode61 remove_diacritics 2', prefix='2 3'
+    );
+    CREATE TRIGGER IF NOT EXISTS photos_fts_ai AFTER INSERT ON photos BEGIN
+      INSERT INTO photos_fts(rowid, orig_filename, owner) VALUES (new.rowid, new.orig_filename, new.owner);
+    END;
+    CREATE TRIGGER IF NOT EXISTS photos_fts_ad AFTER DELETE ON photos BEGIN
+      INSERT INTO photos_fts(photos_fts, rowid, orig_filename, owner) VALUES ('delete', old.rowid, old.orig_filename, old.owner);
+    END;
+    CREATE TRIGGER IF NOT EXISTS photos_fts_au AFTER UPDATE OF orig_filename, owner ON photos BEGIN
+      INSERT INTO photos_fts(photos_fts, rowid, orig_filename, owner) VALUES ('delete', old.rowid, old.orig_filename, old.owner);
+      INSERT INTO photos_fts(rowid, orig_filename, owner) VALUES (new.rowid, new.orig_filename, new.owner);
+    END;
+    )SQL";
+    char *err = nullptr;
+    if (sqlite3_exec(ctx.db, sql, 0, 0, &err) != SQLITE_OK) {
+        std::cerr << "Search index init error: " << (err ? err : "") << std::endl;
+        if (err) sqlite3_free(err);
+        return false;
+    }
+    // index photos that were stored before the search table existed
+    if (!existed) {
+        if (sqlite3_exec(ctx.db, "INSERT INTO photos_fts(photos_fts) VALUES('rebuild');", 0, 0, &err) != SQLITE_OK) {
+            std::cerr << "Search index rebuild error: " << (err ? err : "") << std::endl;
+            if (err) sqlite3_free(err);
+            return false;
+        }
+    }
+    return true;
+}
+// per-(scope, owner, date) photo counts, maintained by triggers so that the timeline
+// and the date list of /api/blocks never have to scan photos
+static bool init_date_counts(AppContext &ctx) {
+    bool existed = table_exists(ctx, "photo_date_counts");
+    const char *sql = R"SQL(
+    CREATE TABLE IF NOT EXISTS photo_date_counts (
+      scope TEXT NOT NULL,
+      owner TEXT NOT NULL,
+      date TEXT NOT NULL,
+      n INTEGER NOT NULL,
+      PRIMARY KEY(scope, owner, date)
+    ) WITHOUT ROWID;
+    CREATE INDEX IF NOT EXISTS idx_date_counts_scope_date ON photo_date_counts(scope, date);
+    CREATE TRIGGER IF NOT EXISTS photo_date_counts_ai AFTER INSERT ON photos BEGIN
+      INSERT INTO photo_date_counts(scope, owner, date, n) VALUES (new.scope, COALESCE(new.owner,''), new.date, 1)
+        ON CONFLICT(scope, owner, date) DO UPDATE SET n = n + 1;
+    END;
+    CREATE TRIGGER IF NOT EXISTS photo_date_counts_ad AFTER DELETE ON photos BEGIN
+      UPDATE photo_date_counts SET n = n - 1 WHERE scope=old.scope AND owner=COALESCE(old.owner,'') AND date=old.date;
+      DELETE FROM photo_date_counts WHERE scope=old.scope AND owner=COALESCE(old.owner,'') AND date=old.date AND n <= 0;
+    END;
+    )SQL";
+    char *err = nullptr;
+    if (sqlite3_exec(ctx.db, sql, 0, 0, &err) != SQLITE_OK) {
+        std::cerr << "Date counts init error: " << (err ? err : "") << std::endl;
+        if (err) sqlite3_free(err);
+        return false;
+    }
+    if (!existed) {
+        const char *backfill = "INSERT INTO photo_date_counts(scope, owner, date, n) "
+                               "SELECT scope, COALESCE(owner,''), date, COUNT(*) FROM photos GROUP BY 1,2,3;";
+        if (sqlite3_exec(ctx.db, backfill, 0, 0, &err) != SQLITE_OK) {
+            std::cerr << "Date counts backfill error: " << (err ? err : "") << std::endl;
+            if (err) sqlite3_free(err);
+            return false;
+        }
+    }
+    return true;
+}
+// append-only change log behind /api/changes and /api/events. Written by triggers, so uploads,
+// deletes (any connection) and scan results are all covered; seq never goes backwards (AUTOINCREMENT).
+static bool init_change_log(AppContext &ctx) {
+    const char *sql = R"SQL(
+    CREATE TABLE IF NOT EXISTS changes (
+      seq INTEGER PRIMARY KEY AUTOINCREMENT,
+      op TEXT NOT NULL,
+      photo_id TEXT NOT NULL,
+      scope TEXT NOT NULL,
+      owner TEXT NOT NULL,
+      date TEXT
+    );
+    CREATE TRIGGER IF NOT EXISTS changes_ai AFTER INSERT ON photos BEGIN
+      INSERT INTO changes(op, photo_id, scope, owner, date) VALUES ('add', new.id, COALESCE(new.scope,''), COALESCE(new.owner,''), new.date);
+    END;
+    CREATE TRIGGER IF NOT EXISTS changes_ad AFTER DELETE ON photos BEGIN
+      INSERT INTO changes(op, photo_id, scope, owner, date) VALUES ('del', old.id, COALESCE(old.scope,''), COALESCE(old.owner,''), old.date);
+    END;
+    -- recreated on every start: finished thumbnail variants are logged too (replicas fetch them)
+    DROP TRIGGER IF EXISTS changes_au;
+    CREATE TRIGGER changes_au AFTER UPDATE OF scan_status, thumb_formats ON photos
+      WHEN old.scan_status IS NOT new.scan_status OR old.thumb_formats IS NOT new.thumb_formats BEGIN
+      INSERT INTO changes(op, photo_id, scope, owner, date) VALUES ('update', new.id, COALESCE(new.scope,''), COALESCE(new.owner,''), new.date);
+    END;
+    )SQL";
+    char *err = nullptr;
+    if (sqlite3_exec(ctx.db, sql, 0, 0, &err) != SQLITE_OK) {
+        std::cerr << "Change log init error: " << (err ? err : "") << std::endl;
+        if (err) sqlite3_free(err);
+        return false;
+    }
+    // keep the newest change_log_keep rows (the newest one always survives, so seq stays known)
+    sqlite3_stmt *st = nullptr;
+    if (sqlite3_prepare_v2(ctx.db, "DELETE FROM changes WHERE seq <= (SELECT MAX(seq) FROM changes) - ?;", -1, &st, NULL) != SQLITE_OK) return false;
+    sqlite3_bind_int(st, 1, std::max(1, ctx.cfg.change_log_keep));
+    bool ok = sqlite3_step(st) == SQLITE_DONE;
+    sqlite3_finalize(st);
+    return ok;
+}
 static bool init_db(AppContext &ctx) {
     if (sqlite3_open(ctx.cfg.db_path.c_str(), &ctx.db) != SQLITE_OK) return false;
+    // background workers and bulk deletes write through their own connections
+    sqlite3_busy_timeout(ctx.db, 5000);
     const char *sql = R"SQL(
     PRAGMA journal_mode=WAL;
     CREATE TABLE IF NOT EXISTS users (
@@ -280,9 +1100,16 @@ static bool init_db(AppContext &ctx) {
       storage_path TEXT,
       thumb_path TEXT,
       meta_path TEXT,
-      created_at TEXT
+      created_at TEXT,
+      placeholder TEXT,
+      thumb_formats TEXT,
+      scan_status TEXT NOT NULL DEFAULT 'clean'
     );
     CREATE INDEX IF NOT EXISTS idx_photos_date ON photos(date);
+    -- files of deleted photos not yet unlinked; survives restarts (see reclaim_worker)
+    CREATE TABLE IF NOT EXISTS reclaim_queue (
+      path TEXT PRIMARY KEY
+    ) WITHOUT ROWID;
     )SQL";
     char *err = nullptr;
     if (sqlite3_exec(ctx.db, sql, 0, 0, &err) != SQLITE_OK) {
@@ -290,12 +1117,23 @@ static bool init_db(AppContext &ctx) {
         if (err) sqlite3_free(err);
         return false;
     }
-    return true;
+    if (!ensure_column(ctx, "photos", "placeholder", "TEXT")) return false;
+    // comma list of variant encodings already attempted (NULL = none yet), see transcode_worker
+    if (!ensure_column(ctx, "photos", "thumb_formats", "TEXT")) return false;
+    // pending_scan -> clean | infected | scan_error (see scan_worker); photos from before scanning count as clean
+    if (!ensure_column(ctx, "photos", "scan_status", "TEXT NOT NULL DEFAULT 'clean'")) return false;
+    // 64-bit dHash stored as a signed integer; NULL until computed (see compute_dhash, phash_backfill)
+    if (!ensure_column(ctx, "photos", "phash", "INTEGER")) return false;
+    // quarantined before the previews were dropped with the original (see set_scan_status)
+    sqlite3_exec(ctx.db, "UPDATE photos SET placeholder=NULL, phash=NULL WHERE scan_status='infected' AND (placeholder IS NOT NULL OR phash IS NOT NULL);", 0, 0, 0);
+    return init_search_index(ctx) && init_date_counts(ctx) && init_change_log(ctx);
 }
 static bool insert_photo_record(AppContext &ctx, const std::string &id, const std::string &owner, const std::string &scope, const std::string &date,
-                                const std::string &orig_filename, const std::string &storage_path, const std::string &thumb_path, const std::string &meta_path) {
+                                const std::string &orig_filename, const std::string &storage_path, const std::string &thumb_path, const std::string &meta_path,
+                                const std::string &placeholder, const std::string &scan_status, const uint64_t *phash = nullptr) {
+    PhaseTimer timer(kPhaseDb);
     sqlite3_stmt *stmt = nullptr;
-    const char *sql = "INSERT INTO photos(id,owner,scope,date,orig_filename,storage_path,thumb_path,meta_path,created_at) VALUES(?,?,?,?,?,?,?,?,?);";
+    const char *sql = "INSERT INTO photos(id,owner,scope,date,orig_filename,storage_path,thumb_path,meta_path,created_at,placeholder,scan_status,phash) VALUES(?,?,?,?,?,?,?,?,?,?,?,?);";
     if (sqlite3_prepare_v2(ctx.db, sql, -1, &stmt, NULL) != SQLITE_OK) return false;
     sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_TRANSIENT);
     sqlite3_bind_text(stmt, 2, owner.c_str(), -1, SQLITE_TRANSIENT);
@@ -306,22 +1144,32 @@ static bool insert_photo_record(AppContext &ctx, const std::string &id, const st
     sqlite3_bind_text(stmt, 7, thumb_path.c_str(), -1, SQLITE_TRANSIENT);
     sqlite3_bind_text(stmt, 8, meta_path.c_str(), -1, SQLITE_TRANSIENT);
     sqlite3_bind_text(stmt, 9, now_iso().c_str(), -1, SQLITE_TRANSIENT);
+    if (placeholder.empty()) sqlite3_bind_null(stmt, 10);
+    else sqlite3_bind_text(stmt, 10, placeholder.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 11, scan_status.c_str(), -1, SQLITE_TRANSIENT);
+    if (phash) sqlite3_bind_int64(stmt, 12, (sqlite3_int64)*phash);
+    else sqlite3_bind_null(stmt, 12);
     bool ok = (sqlite3_step(stmt) == SQLITE_DONE);
     sqlite3_finalize(stmt);
+    if (ok) notify_changes(ctx);
     return ok;
 }
 static bool delete_photo_record(AppContext &ctx, const std::string &id) {
+    PhaseTimer timer(kPhaseDb);
     sqlite3_stmt *stmt = nullptr;
     const char *sql = "DELETE FROM photos WHERE id=?;";
     if (sqlite3_prepare_v2(ctx.db, sql, -1, &stmt, NULL) != SQLITE_OK) return false;
     sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_TRANSIENT);
     bool ok = (sqlite3_step(stmt) == SQLITE_DONE);
     sqlite3_finalize(stmt);
+    if (ok) notify_changes(ctx);
     return ok;
 }
-static bool lookup_photo(AppContext &ctx, const std::string &id, std::string &owner, std::string &scope, std::string &storage_path, std::string &thumb_path, std::string &meta_path) {
+static bool lookup_photo(AppContext &ctx, const std::string &id, std::string &owner, std::string &scope, std::string &storage_path, std::string &thumb_path, std::string &meta_path,
+                         std::string *scan_status = nullptr) {
+    PhaseTimer timer(kPhaseDb);
     sqlite3_stmt *stmt = nullptr;
-    const char *sql = "SELECT owner,scope,storage_path,thumb_path,meta_path FROM photos WHERE id=? LIMIT 1;";
+    const char *sql = "SELECT owner,scope,storage_path,thumb_path,meta_path,scan_status FROM photos WHERE id=? LIMIT 1;";
     if (sqlite3_prepare_v2(ctx.db, sql, -1, &stmt, NULL) != SQLITE_OK) return false;
     sqlite3_bind_text(stmt, 1, id.c_str(), -1, SQLITE_TRANSIENT);
     bool found = false;
@@ -331,55 +1179,1676 @@ static bool lookup_photo(AppContext &ctx, const std::string &id, std::string &ow
         storage_path = (const char*)sqlite3_column_text(stmt,2);
         thumb_path = (const char*)sqlite3_column_text(stmt,3);
         meta_path = (const char*)sqlite3_column_text(stmt,4);
+        if (scan_status) *scan_status = (const char*)sqlite3_column_text(stmt,5);
         found = true;
     }
-    sqlite3_finalize(stmt);
-    return found;
+    sqlite3_finalize(stmt);
+    return found;
+}
+struct PhotoRef {
+    std::string id, owner, scope, storage_path, thumb_path, meta_path, scan_status;
+};
+// one `WHERE id IN (...)` round-trip for many ids (batched thumbs, bulk operations);
+// ids that do not exist are simply absent from the result
+// `id IN (?,?,...)` lists are split into statements of this many ids (SQLite's bound-variable limit
+// is 999 on older builds)
+static constexpr size_t kIdsPerStatement = 500;
+// prepares `head` + "(?,...,?)" + `tail` for ids [from, from+n) and binds them from parameter 1
+static sqlite3_stmt *prepare_id_list(sqlite3 *db, const char *head, const char *tail, const std::vector<std::string> &ids, size_t from, size_t n) {
+    std::string sql = head;
+    sql += "(";
+    for (size_t i = 0; i < n; ++i) sql += (i ? ",?" : "?");
+    sql += ")";
+    sql += tail;
+    sqlite3_stmt *st = nullptr;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &st, NULL) != SQLITE_OK) { sqlite3_finalize(st); return nullptr; }
+    for (size_t i = 0; i < n; ++i) sqlite3_bind_text(st, (int)i + 1, ids[from + i].c_str(), -1, SQLITE_TRANSIENT);
+    return st;
+}
+static std::vector<PhotoRef> lookup_photos(AppContext &ctx, const std::vector<std::string> &ids) {
+    PhaseTimer timer(kPhaseDb);
+    std::vector<PhotoRef> out;
+    for (size_t from = 0; from < ids.size(); from += kIdsPerStatement) {
+        size_t n = std::min(kIdsPerStatement, ids.size() - from);
+        sqlite3_stmt *stmt = prepare_id_list(ctx.db, "SELECT id,owner,scope,storage_path,thumb_path,meta_path,scan_status FROM photos WHERE id IN ", ";", ids, from, n);
+        if (!stmt) break;
+        auto col = [&](int i) { const unsigned char *t = sqlite3_column_text(stmt, i); return t ? std::string((const char*)t) : std::string(); };
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            out.push_back({ col(0), col(1), col(2), col(3), col(4), col(5), col(6) });
+        }
+        sqlite3_finalize(stmt);
+    }
+    return out;
+}
+
+// --- background thumbnail variants ---
+static std::string join_formats(const std::vector<std::string> &formats) {
+    std::string out;
+    for (const auto &f : formats) out += (out.empty() ? "" : ",") + f;
+    return out;
+}
+static void enqueue_transcode(AppContext &ctx, const std::string &id) {
+    if (ctx.transcode) queue_push(*ctx.transcode, id);
+}
+// single niced worker: encodes the configured variants for queued photos one at a time and records
+// the attempted format list, so a library is only re-encoded when thumbnail_formats changes.
+// At startup every clean photo whose list differs from the configuration is queued (existing
+// libraries); photos still waiting for a virus scan are queued by scan_worker once they pass.
+static void transcode_worker(AppContext ctx) {
+    const std::string formats = join_formats(ctx.cfg.thumb_formats);
+    {
+        sqlite3_stmt *st = nullptr;
+        if (sqlite3_prepare_v2(ctx.db, "SELECT id FROM photos WHERE thumb_formats IS NOT ? AND scan_status='clean' ORDER BY date DESC;", -1, &st, NULL) == SQLITE_OK) {
+            sqlite3_bind_text(st, 1, formats.c_str(), -1, SQLITE_TRANSIENT);
+            std::lock_guard<std::mutex> lk(ctx.transcode->m);
+            while (sqlite3_step(st) == SQLITE_ROW) ctx.transcode->ids.push_back((const char*)sqlite3_column_text(st, 0));
+            if (!ctx.transcode->ids.empty()) std::cout << "Thumbnail variants: " << ctx.transcode->ids.size() << " photos queued" << std::endl;
+        }
+        sqlite3_finalize(st);
+    }
+    for (;;) {
+        std::string id = queue_pop(*ctx.transcode);
+        std::string owner, scope, storage_path, thumb_path, meta_path;
+        if (!lookup_photo(ctx, id, owner, scope, storage_path, thumb_path, meta_path) || thumb_path.empty()) continue;
+        const std::string &src = access(storage_path.c_str(), R_OK) == 0 ? storage_path : thumb_path;
+        for (const auto &name : ctx.cfg.thumb_formats) {
+            const ThumbFormat *f = find_thumb_format(name);
+            std::string dst = thumb_variant_path(thumb_path, f->ext);
+            PackLoc loc;
+            if (access(dst.c_str(), F_OK) == 0 || (ctx.thumbs && ctx.thumbs->find(thumb_key(id, f->ext), loc))) continue;
+            if (!create_thumbnail_variant(src, dst, ctx.cfg.thumb_size, *f))
+                std::cerr << "Warning: " << f->ext << " thumbnail failed for " << id << std::endl;
+            else if (ctx.thumbs) ctx.thumbs->put_file(thumb_key(id, f->ext), dst);
+        }
+        sqlite3_stmt *st = nullptr;
+        if (sqlite3_prepare_v2(ctx.db, "UPDATE photos SET thumb_formats=? WHERE id=?;", -1, &st, NULL) == SQLITE_OK) {
+            sqlite3_bind_text(st, 1, formats.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(st, 2, id.c_str(), -1, SQLITE_TRANSIENT);
+            if (sqlite3_step(st) == SQLITE_DONE) notify_changes(ctx);
+        }
+        sqlite3_finalize(st);
+    }
+}
+// --migrate-thumbs: move existing <id>.thumb.{jpg,webp,avif} files into the pack
+static size_t migrate_thumb_files(AppContext &ctx) {
+    size_t moved = 0;
+    sqlite3_stmt *st = nullptr;
+    if (sqlite3_prepare_v2(ctx.db, "SELECT id,thumb_path FROM photos;", -1, &st, NULL) != SQLITE_OK) return 0;
+    while (sqlite3_step(st) == SQLITE_ROW) {
+        const unsigned char *tp = sqlite3_column_text(st, 1);
+        if (!tp || !*tp) continue;
+        std::string id = (const char*)sqlite3_column_text(st, 0), thumb_path = (const char*)tp;
+        auto move = [&](const char *ext, const std::string &path) {
+            if (access(path.c_str(), R_OK) != 0) return;
+            if (ctx.thumbs->put_file(thumb_key(id, ext), path)) ++moved;
+            else std::cerr << "Warning: could not pack " << path << std::endl;
+        };
+        move("jpg", thumb_path);
+        for (const auto &f : kThumbFormats) move(f.ext, thumb_variant_path(thumb_path, f.ext));
+    }
+    sqlite3_finalize(st);
+    return moved;
+}
+// every stored thumbnail of a photo: loose files (not yet migrated) and pack entries
+static void remove_thumbs(AppContext &ctx, const std::string &id, const std::string &thumb_path) {
+    if (!thumb_path.empty()) {
+        unlink(thumb_path.c_str());
+        for (const auto &f : kThumbFormats) unlink(thumb_variant_path(thumb_path, f.ext).c_str());
+    }
+    if (ctx.thumbs) {
+        ctx.thumbs->remove(thumb_key(id, "jpg"));
+        for (const auto &f : kThumbFormats) ctx.thumbs->remove(thumb_key(id, f.ext));
+    }
+}
+
+// --- bulk delete: rows are removed in one transaction, files are unlinked later by reclaim_worker ---
+static sqlite3 *open_db_connection(const Config &cfg) {
+    sqlite3 *db = nullptr;
+    if (sqlite3_open(cfg.db_path.c_str(), &db) != SQLITE_OK) { sqlite3_close(db); return nullptr; }
+    sqlite3_busy_timeout(db, 5000);
+    return db;
+}
+static bool exec_step(sqlite3_stmt *st) {
+    bool ok = sqlite3_step(st) == SQLITE_DONE;
+    sqlite3_reset(st);
+    return ok;
+}
+// deletes the rows (triggers keep search/date counts in step) and records their files in
+// reclaim_queue within the same transaction, so a crash cannot leak or lose files. Runs on its own
+// connection: a transaction on the shared ctx.db would also swallow other requests' writes.
+static bool delete_photos(AppContext &ctx, const std::vector<PhotoRef> &photos) {
+    PhaseTimer timer(kPhaseDb);
+    sqlite3 *db = open_db_connection(ctx.cfg);
+    if (!db) return false;
+    std::vector<std::string> files;
+    for (const auto &p : photos) {
+        for (const std::string *f : { &p.storage_path, &p.meta_path, &p.thumb_path }) if (!f->empty()) files.push_back(*f);
+        if (!p.thumb_path.empty())
+            for (const auto &f : kThumbFormats) files.push_back(thumb_variant_path(p.thumb_path, f.ext));
+    }
+    sqlite3_stmt *del = nullptr, *ins = nullptr;
+    bool ok = sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) == SQLITE_OK &&
+              sqlite3_prepare_v2(db, "DELETE FROM photos WHERE id=?;", -1, &del, NULL) == SQLITE_OK &&
+              sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO reclaim_queue(path) VALUES(?);", -1, &ins, NULL) == SQLITE_OK;
+    for (size_t i = 0; ok && i < photos.size(); ++i) {
+        sqlite3_bind_text(del, 1, photos[i].id.c_str(), -1, SQLITE_TRANSIENT);
+        ok = exec_step(del);
+    }
+    for (size_t i = 0; ok && i < files.size(); ++i) {
+        sqlite3_bind_text(ins, 1, files[i].c_str(), -1, SQLITE_TRANSIENT);
+        ok = exec_step(ins);
+    }
+    sqlite3_finalize(del);
+    sqlite3_finalize(ins);
+    ok = ok && sqlite3_exec(db, "COMMIT;", 0, 0, 0) == SQLITE_OK;
+    if (!ok) sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    sqlite3_close(db);
+    if (!ok) return false;
+    notify_changes(ctx);
+    // pack entries are only tombstoned (cheap); compaction reclaims their space
+    for (const auto &p : photos) {
+        if (!ctx.thumbs) break;
+        ctx.thumbs->remove(thumb_key(p.id, "jpg"));
+        for (const auto &f : kThumbFormats) ctx.thumbs->remove(thumb_key(p.id, f.ext));
+    }
+    if (ctx.reclaim) {
+        std::lock_guard<std::mutex> lk(ctx.reclaim->m);
+        for (auto &f : files) ctx.reclaim->ids.push_back(std::move(f));
+    }
+    if (ctx.reclaim) ctx.reclaim->cv.notify_one();
+    return true;
+}
+// unlinks queued files at most cfg.reclaim_per_second, in the idle I/O class, and drops them from
+// reclaim_queue in batches (one commit per batch instead of one per file)
+static void reclaim_worker(AppContext ctx) {
+#ifdef SYS_ioprio_set
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS: this thread */, 0, 3 << 13 /* IOPRIO_CLASS_IDLE */);
+#endif
+    sqlite3 *db = open_db_connection(ctx.cfg);
+    if (!db) return;
+    {
+        sqlite3_stmt *st = nullptr;
+        if (sqlite3_prepare_v2(db, "SELECT path FROM reclaim_queue;", -1, &st, NULL) == SQLITE_OK) {
+            std::lock_guard<std::mutex> lk(ctx.reclaim->m);
+            while (sqlite3_step(st) == SQLITE_ROW) ctx.reclaim->ids.push_back((const char*)sqlite3_column_text(st, 0));
+        }
+        sqlite3_finalize(st);
+    }
+    const auto gap = std::chrono::microseconds(1000000 / std::max(1, ctx.cfg.reclaim_per_second));
+    for (;;) {
+        std::vector<std::string> batch = queue_pop_some(*ctx.reclaim, 256);
+        for (const auto &path : batch) {
+            if (unlink(path.c_str()) == 0) std::this_thread::sleep_for(gap);
+            else if (errno != ENOENT) std::cerr << "Warning: cannot remove " << path << ": " << std::strerror(errno) << std::endl;
+        }
+        sqlite3_stmt *st = nullptr;
+        if (sqlite3_exec(db, "BEGIN;", 0, 0, 0) == SQLITE_OK &&
+            sqlite3_prepare_v2(db, "DELETE FROM reclaim_queue WHERE path=?;", -1, &st, NULL) == SQLITE_OK) {
+            for (const auto &path : batch) {
+                sqlite3_bind_text(st, 1, path.c_str(), -1, SQLITE_TRANSIENT);
+                exec_step(st);
+            }
+        }
+        sqlite3_finalize(st);
+        sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+    }
+}
+// --- virus scanning: uploads stay pending_scan until clamd has seen them ---
+// Unreachable: clamd could not be asked (retried indefinitely); Error: clamd answered "... ERROR" (capped)
+enum class ScanResult { Clean, Infected, Error, Unreachable };
+static bool send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+// clamd INSTREAM: "zINSTREAM\0", then <u32 be length><bytes> chunks, terminated by a zero length;
+// the reply is "stream: OK", "stream: <signature> FOUND" or "... ERROR" (e.g. StreamMaxLength)
+static ScanResult clamd_scan_file(const std::string &socket_path, const std::string &path, std::string &reply) {
+    reply.clear();
+    std::ifstream in(path, std::ios::binary);
+    if (!in) { reply = "cannot open " + path; return ScanResult::Error; }
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) { reply = "clamd_socket path too long"; return ScanResult::Error; }
+    std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) { reply = std::strerror(errno); return ScanResult::Unreachable; }
+    struct timeval tv = { 60, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        reply = "connect " + socket_path + ": " + std::strerror(errno);
+        close(fd);
+        return ScanResult::Unreachable;
+    }
+    bool sent = send_all(fd, "zINSTREAM", 10);
+    std::vector<char> buf(4 + 64 * 1024);
+    while (sent && in) {
+        in.read(buf.data() + 4, 64 * 1024);
+        std::streamsize n = in.gcount();
+        if (n <= 0) break;
+        for (int i = 0; i < 4; ++i) buf[i] = (char)((uint32_t)n >> (24 - 8 * i));
+        sent = send_all(fd, buf.data(), 4 + (size_t)n);
+    }
+    if (sent) sent = send_all(fd, "\0\0\0\0", 4);
+    // read the reply even if sending failed: clamd reports size-limit errors and then closes
+    char c;
+    while (reply.size() < 1024) {
+        ssize_t n = recv(fd, &c, 1, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || c == '\0' || c == '\n') break;
+        reply.push_back(c);
+    }
+    close(fd);
+    if (reply == "stream: OK") return ScanResult::Clean;
+    if (reply.size() > 6 && reply.compare(reply.size() - 6, 6, " FOUND") == 0) return ScanResult::Infected;
+    // a dropped connection without an answer means clamd went away, not that the file is bad
+    if (reply.empty()) { reply = "no reply from clamd"; return ScanResult::Unreachable; }
+    return ScanResult::Error;
+}
+static void clear_scan_failures(AppContext &ctx, const std::string &id) {
+    std::lock_guard<std::mutex> lk(ctx.scan->m);
+    ctx.scan->failures.erase(id);
+}
+static bool set_scan_status(AppContext &ctx, const std::string &id, const char *status, const std::string &storage_path) {
+    // the placeholder and dHash were computed from the upload before the scan: infected drops them too
+    const char *sql = std::strcmp(status, "infected") == 0
+        ? "UPDATE photos SET scan_status=?, storage_path=?, placeholder=NULL, phash=NULL WHERE id=?;"
+        : "UPDATE photos SET scan_status=?, storage_path=? WHERE id=?;";
+    sqlite3_stmt *st = nullptr;
+    if (sqlite3_prepare_v2(ctx.db, sql, -1, &st, NULL) != SQLITE_OK) return false;
+    sqlite3_bind_text(st, 1, status, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(st, 2, storage_path.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(st, 3, id.c_str(), -1, SQLITE_TRANSIENT);
+    bool ok = sqlite3_step(st) == SQLITE_DONE;
+    sqlite3_finalize(st);
+    if (ok) notify_changes(ctx);
+    return ok;
+}
+// one of cfg.scan_workers threads sharing ctx.scan. Clean photos are published (and get their
+// thumbnail variants); infected originals move to storage_root/quarantine and their derived
+// thumbnails are dropped. While clamd is unreachable the photo is re-queued after a back-off;
+// clamd ERROR replies are retried the same way up to scan_max_attempts, then the photo is scan_error.
+static void scan_worker(AppContext ctx) {
+    const std::string quarantine_dir = ctx.cfg.storage_root + "/quarantine";
+    for (;;) {
+        std::string id = queue_pop(*ctx.scan);
+        std::string owner, scope, storage_path, thumb_path, meta_path, status;
+        if (!lookup_photo(ctx, id, owner, scope, storage_path, thumb_path, meta_path, &status) || status != "pending_scan") continue;
+        // deleted while queued; anything else left pending is picked up again on the next start
+        if (access(storage_path.c_str(), R_OK) != 0) continue;
+        std::string reply;
+        ScanResult r = clamd_scan_file(ctx.cfg.clamd_socket, storage_path, reply);
+        if (r == ScanResult::Clean) {
+            clear_scan_failures(ctx, id);
+            set_scan_status(ctx, id, "clean", storage_path);
+            enqueue_transcode(ctx, id);
+        } else if (r == ScanResult::Infected) {
+            std::string dst = quarantine_dir + "/" + storage_path.substr(storage_path.find_last_of('/') + 1);
+            if (rename(storage_path.c_str(), dst.c_str()) != 0) {
+                // never leave an infected original where /images could reach it
+                remove_if_exists(storage_path);
+                dst.clear();
+            } else {
+                chmod(dst.c_str(), 0600);
+            }
+            remove_thumbs(ctx, id, thumb_path);
+            clear_scan_failures(ctx, id);
+            set_scan_status(ctx, id, "infected", dst);
+            std::cerr << "Quarantined " << id << " (" << reply << ")" << std::endl;
+        } else if (r == ScanResult::Unreachable) {
+            std::cerr << "Warning: clamd unreachable (" << reply << "), retrying " << id << " in " << ctx.cfg.scan_retry_seconds << "s" << std::endl;
+            queue_push_later(*ctx.scan, id, ctx.cfg.scan_retry_seconds);
+        } else {
+            int failures;
+            {
+                std::lock_guard<std::mutex> lk(ctx.scan->m);
+                failures = ++ctx.scan->failures[id];
+                if (failures >= ctx.cfg.scan_max_attempts) ctx.scan->failures.erase(id);
+            }
+            if (failures < ctx.cfg.scan_max_attempts) {
+                std::cerr << "Warning: scan of " << id << " failed: " << reply << ", retrying in " << ctx.cfg.scan_retry_seconds << "s" << std::endl;
+                queue_push_later(*ctx.scan, id, ctx.cfg.scan_retry_seconds);
+            } else {
+                // stays unpublished; the next start tries it again
+                set_scan_status(ctx, id, "scan_error", storage_path);
+                std::cerr << "Scan of " << id << " gave up after " << failures << " attempts: " << reply << std::endl;
+            }
+        }
+    }
+}
+// /images and /thumbs until the scan has passed: 202 (try again later), 423 (quarantined) or 422 (clamd kept failing)
+static bool reject_unscanned(const std::string &scan_status, Response &res) {
+    if (scan_status == "pending_scan") {
+        res.status = 202;
+        res.set_header("Retry-After", "5");
+        res.set_content("{\"error\":\"scan_pending\"}", "application/json");
+        return true;
+    }
+    if (scan_status == "infected") {
+        res.status = 423;
+        res.set_content("{\"error\":\"quarantined\"}", "application/json");
+        return true;
+    }
+    if (scan_status == "scan_error") {
+        res.status = 422;
+        res.set_content("{\"error\":\"scan_failed\"}", "application/json");
+        return true;
+    }
+    return false;
+}
+// --- streaming JSON output ---
+// Writes straight into a caller-owned buffer (see json_buffer) instead of building an
+// nlohmann DOM; values can be passed as raw sqlite3_column_text pointers without copies.
+class JsonWriter {
+public:
+    explicit JsonWriter(std::string &out) : out_(out) {}
+    JsonWriter &begin_object() { sep(); out_.push_back('{'); push(); return *this; }
+    JsonWriter &end_object() { out_.push_back('}'); --depth_; return *this; }
+    JsonWriter &begin_array() { sep(); out_.push_back('['); push(); return *this; }
+    JsonWriter &end_array() { out_.push_back(']'); --depth_; return *this; }
+    JsonWriter &key(const char *k) { sep(); str(k, std::strlen(k)); out_.push_back(':'); after_key_ = true; return *this; }
+    JsonWriter &value(const char *v) { if (!v) return null(); sep(); str(v, std::strlen(v)); return *this; }
+    JsonWriter &value(const unsigned char *v) { return value((const char*)v); }
+    JsonWriter &value(const std::string &v) { sep(); str(v.data(), v.size()); return *this; }
+    JsonWriter &value(long long v) { sep(); char b[24]; int n = std::snprintf(b, sizeof(b), "%lld", v); out_.append(b, n); return *this; }
+    JsonWriter &null() { sep(); out_.append("null"); return *this; }
+    // already-serialized JSON (e.g. a value taken over from a metadata file)
+    JsonWriter &raw(const std::string &v) { sep(); out_.append(v); return *this; }
+    // string value assembled from pieces, e.g. "/thumbs/" + id + "?t=" + token, without temporaries
+    JsonWriter &value_concat(std::initializer_list<const char*> parts) {
+        sep();
+        out_.push_back('"');
+        for (const char *p : parts) if (p) escape(p, std::strlen(p));
+        out_.push_back('"');
+        return *this;
+    }
+private:
+    void push() { if (depth_ < kMaxDepth) first_[depth_] = true; ++depth_; }
+    void sep() {
+        if (after_key_) { after_key_ = false; return; }
+        if (depth_ > 0 && depth_ <= kMaxDepth) {
+            if (!first_[depth_ - 1]) out_.push_back(',');
+            first_[depth_ - 1] = false;
+        }
+    }
+    void str(const char *s, size_t n) { out_.push_back('"'); escape(s, n); out_.push_back('"'); }
+    void escape(const char *s, size_t n) {
+        static const char hex[] = "0123456789abcdef";
+        size_t run = 0; // copy unescaped runs in one append
+        for (size_t i = 0; i < n; ++i) {
+            unsigned char c = (unsigned char)s[i];
+            if (c >= 0x20 && c != '"' && c != '\\') continue;
+            out_.append(s + run, i - run);
+            run = i + 1;
+            switch (c) {
+                case '"': out_.append("\\\""); break;
+                case '\\': out_.append("\\\\"); break;
+                case '\n': out_.append("\\n"); break;
+                case '\r': out_.append("\\r"); break;
+                case '\t': out_.append("\\t"); break;
+                default: out_.append("\\u00"); out_.push_back(hex[c >> 4]); out_.push_back(hex[c & 15]);
+            }
+        }
+        out_.append(s + run, n - run);
+    }
+    static const int kMaxDepth = 16;
+    std::string &out_;
+    bool first_[kMaxDepth] = {};
+    int depth_ = 0;
+    bool after_key_ = false;
+};
+// per-thread output buffer: keeps its capacity between requests, so steady-state
+// serialization does not allocate
+static std::string &json_buffer() {
+    thread_local std::string buf;
+    buf.clear();
+    return buf;
+}
+// one photo entry as used by /api/blocks and /api/search; columns are read in place from the
+// statement, starting at `c`: id,owner,scope,orig_filename,created_at,placeholder,scan_status
+// (c_date is optional, pass -1 to omit)
+static void write_photo_entry(JsonWriter &w, sqlite3_stmt *st, int c, int c_date, const std::string &token) {
+    const int c_id = c, c_owner = c + 1, c_scope = c + 2, c_orig = c + 3, c_created = c + 4, c_placeholder = c + 5, c_scan = c + 6;
+    const char *id = (const char*)sqlite3_column_text(st, c_id);
+    const char *t = token.empty() ? nullptr : "?t=";
+    const char *tok = token.empty() ? nullptr : token.c_str();
+    w.begin_object();
+    w.key("id").value(id);
+    w.key("owner").value(sqlite3_column_text(st, c_owner));
+    w.key("scope").value(sqlite3_column_text(st, c_scope));
+    w.key("orig_name").value(sqlite3_column_text(st, c_orig));
+    w.key("thumb_url").value_concat({ "/thumbs/", id, t, tok });
+    w.key("full_url").value_concat({ "/images/", id, t, tok });
+    w.key("created_at").value(sqlite3_column_text(st, c_created));
+    if (c_date >= 0) w.key("date").value(sqlite3_column_text(st, c_date));
+    // no preview of anything clamd has not passed; the client skips such entries until an update says clean
+    const char *scan = (const char*)sqlite3_column_text(st, c_scan);
+    bool clean = !scan || std::strcmp(scan, "clean") == 0;
+    if (clean && sqlite3_column_type(st, c_placeholder) != SQLITE_NULL)
+        w.key("placeholder").value(sqlite3_column_text(st, c_placeholder));
+    if (!clean) w.key("scan_status").value(scan);
+    w.end_object();
+}
+// blocks of photos grouped by date, newest first. Visibility: scope="shared" -> shared photos,
+// scope="" + owner -> that owner's personal photos. `until` is an exclusive upper bound on date
+// (keyset pagination, see date_upper_bound); `token` is appended to personal photo URLs.
+static void write_blocks(AppContext &ctx, JsonWriter &w, const std::string &scope, const std::string &owner, const std::string &until,
+                         int start, int count, const std::string &token) {
+    PhaseTimer timer(kPhaseDb);
+    w.begin_array();
+    sqlite3_stmt *stmt = nullptr;
+    sqlite3_stmt *ps = nullptr;
+    const char *sql_dates = "SELECT DISTINCT date FROM photo_date_counts WHERE (scope=? OR (scope='personal' AND owner=?)) AND date < ? ORDER BY date DESC LIMIT ? OFFSET ?;";
+    const char *sql_ph = "SELECT id,owner,scope,orig_filename,created_at,placeholder,scan_status FROM photos WHERE date=? AND (scope=? OR (scope='personal' AND owner=?)) ORDER BY created_at DESC;";
+    if (sqlite3_prepare_v2(ctx.db, sql_dates, -1, &stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(ctx.db, sql_ph, -1, &ps, NULL) != SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        w.end_array();
+        return;
+    }
+    sqlite3_bind_text(stmt, 1, scope.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, owner.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 3, until.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 4, count);
+    sqlite3_bind_int(stmt, 5, start);
+    sqlite3_bind_text(ps, 2, scope.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(ps, 3, owner.c_str(), -1, SQLITE_TRANSIENT);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        // the photos statement is prepared once and re-bound per date
+        sqlite3_reset(ps);
+        sqlite3_bind_text(ps, 1, (const char*)sqlite3_column_text(stmt, 0), -1, SQLITE_TRANSIENT);
+        w.begin_object();
+        w.key("date").value(sqlite3_column_text(stmt, 0));
+        w.key("photos").begin_array();
+        while (sqlite3_step(ps) == SQLITE_ROW) write_photo_entry(w, ps, 0, -1, token);
+        w.end_array();
+        w.end_object();
+    }
+    sqlite3_finalize(ps);
+    sqlite3_finalize(stmt);
+    w.end_array();
+}
+// dates are stored as fixed-width YYYY-MM-DD, so "<date>~" sorts right after <date>:
+// ?before=D pages strictly older than D, ?from=D jumps to D itself (inclusive)
+static std::string date_upper_bound(const Request &req) {
+    if (req.has_param("before")) return req.get_param_value("before");
+    if (req.has_param("from")) return req.get_param_value("from") + "~";
+    return "~";
+}
+// year -> month -> day counts for the timeline scrubber, read from photo_date_counts only
+static json get_timeline(AppContext &ctx, const std::string &scope, const std::string &owner) {
+    PhaseTimer timer(kPhaseDb);
+    json out;
+    out["total"] = 0;
+    out["years"] = json::array();
+    sqlite3_stmt *stmt = nullptr;
+    const char *sql = "SELECT date, SUM(n) FROM photo_date_counts WHERE (scope=? OR (scope='personal' AND owner=?)) GROUP BY date ORDER BY date DESC;";
+    if (sqlite3_prepare_v2(ctx.db, sql, -1, &stmt, NULL) != SQLITE_OK) return out;
+    sqlite3_bind_text(stmt, 1, scope.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, owner.c_str(), -1, SQLITE_TRANSIENT);
+    long long total = 0;
+    json *year = nullptr;
+    json *month = nullptr;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        std::string date = (const char*)sqlite3_column_text(stmt, 0);
+        long long n = sqlite3_column_int64(stmt, 1);
+        if (date.size() < 10) continue;
+        std::string y = date.substr(0, 4), m = date.substr(0, 7);
+        if (!year || (*year)["year"] != y) {
+            out["years"].push_back({ {"year", y}, {"count", 0}, {"months", json::array()} });
+            year = &out["years"].back();
+            month = nullptr;
+        }
+        if (!month || (*month)["month"] != m) {
+            (*year)["months"].push_back({ {"month", m}, {"count", 0}, {"days", json::array()} });
+            month = &(*year)["months"].back();
+        }
+        (*month)["days"].push_back({ {"date", date}, {"count", n} });
+        (*month)["count"] = (*month)["count"].get<long long>() + n;
+        (*year)["count"] = (*year)["count"].get<long long>() + n;
+        total += n;
+    }
+    sqlite3_finalize(stmt);
+    out["total"] = total;
+    return out;
+}
+// turn free text into an FTS5 query: every word becomes a quoted prefix term, so
+// user input can never inject FTS syntax and "IMG_12" matches "IMG_1234.jpg"
+static std::string build_fts_query(const std::string &q) {
+    std::string out, term;
+    auto flush = [&]() {
+        if (term.empty()) return;
+        if (!out.empty()) out.push_back(' ');
+        out += "\"" + term + "\"*";
+        term.clear();
+    };
+    for (unsigned char c : q) {
+        if (std::isalnum(c) || c >= 0x80) term.push_back((char)c);
+        else flush();
+    }
+    flush();
+    return out;
+}
+// search by filename/owner with the same visibility rules as /api/blocks;
+// keyset pagination on rowid (newest first), `before` = cursor from the previous page
+static void write_search(AppContext &ctx, JsonWriter &w, const std::string &scope, const std::string &owner, const std::string &fts_query,
+                         long long before, int limit, const std::string &token) {
+    PhaseTimer timer(kPhaseDb);
+    w.begin_object();
+    w.key("photos").begin_array();
+    sqlite3_stmt *stmt = nullptr;
+    const char *sql = "SELECT p.rowid,p.id,p.owner,p.scope,p.orig_filename,p.created_at,p.placeholder,p.scan_status,p.date FROM photos_fts f JOIN photos p ON p.rowid=f.rowid "
+                      "WHERE photos_fts MATCH ? AND f.rowid < ? AND (p.scope=? OR (p.scope='personal' AND p.owner=?)) "
+                      "ORDER BY f.rowid DESC LIMIT ?;";
+    long long last = 0;
+    int n = 0;
+    if (sqlite3_prepare_v2(ctx.db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, fts_query.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 2, before);
+        // personal searches only see the caller's own photos, shared searches only shared ones
+        sqlite3_bind_text(stmt, 3, scope == "personal" ? "" : scope.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 4, scope == "personal" ? owner.c_str() : "", -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 5, limit);
+        const std::string &url_token = scope == "personal" ? token : std::string();
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            last = sqlite3_column_int64(stmt, 0);
+            // search results span dates, so each entry also carries its date
+            write_photo_entry(w, stmt, 1, 8, url_token);
+            ++n;
+        }
+        sqlite3_finalize(stmt);
+    }
+    w.end_array();
+    w.key("next");
+    if (n == limit) w.value(std::to_string(last));
+    else w.null();
+    w.end_object();
+}
+
+// oldest and newest retained change seq (0,0 while the log is empty)
+static void change_log_bounds(sqlite3 *db, long long &lo, long long &hi) {
+    lo = hi = 0;
+    sqlite3_stmt *st = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT COALESCE(MIN(seq),0), COALESCE(MAX(seq),0) FROM changes;", -1, &st, NULL) != SQLITE_OK) return;
+    if (sqlite3_step(st) == SQLITE_ROW) { lo = sqlite3_column_int64(st, 0); hi = sqlite3_column_int64(st, 1); }
+    sqlite3_finalize(st);
+}
+// newest change after `since` visible to (scope, owner) (same rules as write_blocks), 0 if none
+static long long last_visible_change(sqlite3 *db, long long since, const std::string &scope, const std::string &owner) {
+    sqlite3_stmt *st = nullptr;
+    const char *sql = "SELECT COALESCE(MAX(seq),0) FROM changes WHERE seq > ? AND (scope=? OR (scope='personal' AND owner=?));";
+    if (sqlite3_prepare_v2(db, sql, -1, &st, NULL) != SQLITE_OK) return 0;
+    sqlite3_bind_int64(st, 1, since);
+    sqlite3_bind_text(st, 2, scope.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(st, 3, owner.c_str(), -1, SQLITE_TRANSIENT);
+    long long seq = sqlite3_step(st) == SQLITE_ROW ? sqlite3_column_int64(st, 0) : 0;
+    sqlite3_finalize(st);
+    return seq;
+}
+// changes in (since, head], oldest first: {"seq":<next cursor>,"more":bool,"changes":[{"seq","op","id","date","photo"}]}.
+// "photo" (a /api/blocks entry) is present for add/update while the photo still exists; a photo that
+// is gone by now has its "del" further down the log.
+static void write_changes(AppContext &ctx, JsonWriter &w, const std::string &scope, const std::string &owner,
+                          long long since, long long head, int limit, const std::string &token) {
+    PhaseTimer timer(kPhaseDb);
+    const char *sql = "SELECT c.seq,c.op,c.photo_id,c.date,p.id,p.owner,p.scope,p.orig_filename,p.created_at,p.placeholder,p.scan_status "
+                      "FROM changes c LEFT JOIN photos p ON p.id=c.photo_id AND c.op<>'del' "
+                      "WHERE c.seq > ? AND c.seq <= ? AND (c.scope=? OR (c.scope='personal' AND c.owner=?)) ORDER BY c.seq LIMIT ?;";
+    sqlite3_stmt *st = nullptr;
+    w.begin_object();
+    long long next = head;
+    int n = 0;
+    w.key("changes").begin_array();
+    if (sqlite3_prepare_v2(ctx.db, sql, -1, &st, NULL) == SQLITE_OK) {
+        sqlite3_bind_int64(st, 1, since);
+        sqlite3_bind_int64(st, 2, head);
+        sqlite3_bind_text(st, 3, scope.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(st, 4, owner.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(st, 5, limit);
+        while (sqlite3_step(st) == SQLITE_ROW) {
+            next = sqlite3_column_int64(st, 0);
+            ++n;
+            w.begin_object();
+            w.key("seq").value(next);
+            w.key("op").value(sqlite3_column_text(st, 1));
+            w.key("id").value(sqlite3_column_text(st, 2));
+            w.key("date").value(sqlite3_column_text(st, 3));
+            if (sqlite3_column_type(st, 4) != SQLITE_NULL) {
+                w.key("photo");
+                write_photo_entry(w, st, 4, 3, token);
+            }
+            w.end_object();
+        }
+        sqlite3_finalize(st);
+    }
+    w.end_array();
+    // a short page means everything up to head was seen, including changes this caller may not see
+    bool more = n == limit;
+    if (!more) next = head;
+    w.key("seq").value(next);
+    w.key("more").raw(more ? "true" : "false");
+    w.end_object();
+}
+
+// --- streaming ZIP export (store method, ZIP64 where needed) ---
+struct ZipEntry {
+    std::string name, path;
+    uint64_t size = 0;      // from stat(); exactly this many bytes are streamed
+    uint16_t dos_time = 0, dos_date = 0;
+    uint32_t crc = 0;
+    uint64_t offset = 0;    // of the local header
+    bool written = false;   // false if the file vanished before its turn
+};
+// names inside the archive: keep UTF-8, drop path separators and control characters
+static std::string zip_entry_name(const std::string &name) {
+    std::string out;
+    for (unsigned char c : name) out.push_back(c < 0x20 || c == '/' || c == '\\' || c == ':' ? '_' : (char)c);
+    size_t lead = out.find_first_not_of('.');
+    out = lead == std::string::npos ? std::string() : out.substr(lead);
+    return out.empty() ? std::string("photo") : out;
+}
+static bool zip_entry_from_file(ZipEntry &e, const std::string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    e.path = path;
+    e.size = (uint64_t)st.st_size;
+    struct tm tm;
+    localtime_r(&st.st_mtime, &tm);
+    e.dos_time = (uint16_t)((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+    e.dos_date = (uint16_t)((std::max(0, tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+    return true;
+}
+// Produces the archive piece by piece for a chunked content provider: one local header, the file in
+// 64 KB reads (CRC-32 updated on the way, sent in a data descriptor after the data), and finally the
+// central directory. Only one file is open and one buffer allocated at a time.
+class ZipStream {
+public:
+    explicit ZipStream(std::vector<ZipEntry> entries) : entries_(std::move(entries)) {}
+    ~ZipStream() { if (fd_ >= 0) close(fd_); }
+    // writes the next piece; calls sink.done() after the end record; false aborts the response
+    bool next(DataSink &sink) {
+        out_.clear();
+        if (cur_ < entries_.size()) {
+            if (!step_entry()) return false;
+        } else if (cd_ < entries_.size()) {
+            if (cd_ == 0) cd_offset_ = offset_;
+            while (cd_ < entries_.size() && out_.size() < kChunk) central_header(entries_[cd_++]);
+        } else {
+            end_records();
+            offset_ += out_.size();
+            if (!sink.write(out_.data(), out_.size())) return false;
+            sink.done();
+            return true;
+        }
+        offset_ += out_.size();
+        return out_.empty() || sink.write(out_.data(), out_.size());
+    }
+private:
+    static constexpr size_t kChunk = 64 * 1024;
+    static bool needs_zip64(const ZipEntry &e) { return e.size >= 0xFFFFFFFFu; }
+    bool step_entry() {
+        ZipEntry &e = entries_[cur_];
+        if (fd_ < 0) {
+            fd_ = open(e.path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd_ < 0) { ++cur_; return true; } // deleted meanwhile: leave it out
+#ifdef POSIX_FADV_SEQUENTIAL
+            posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+            e.offset = offset_;
+            e.written = true;
+            crc_ = crc32(0L, Z_NULL, 0);
+            left_ = e.size;
+            local_header(e);
+            return true;
+        }
+        if (left_ > 0) {
+            // read straight into the output buffer, which keeps its capacity between pieces
+            out_.resize((size_t)std::min<uint64_t>(left_, kChunk));
+            ssize_t n = read(fd_, &out_[0], out_.size());
+            if (n <= 0) return false; // shrank or I/O error: the sizes already sent would be wrong
+            out_.resize((size_t)n);
+            crc_ = crc32(crc_, (const Bytef*)out_.data(), (uInt)n);
+            left_ -= (uint64_t)n;
+            return true;
+        }
+        close(fd_);
+        fd_ = -1;
+        e.crc = (uint32_t)crc_;
+        put_le(out_, 0x08074b50, 4);
+        put_le(out_, e.crc, 4);
+        int w = needs_zip64(e) ? 8 : 4;
+        put_le(out_, e.size, w);
+        put_le(out_, e.size, w);
+        ++cur_;
+        return true;
+    }
+    void local_header(const ZipEntry &e) {
+        bool z64 = needs_zip64(e);
+        put_le(out_, 0x04034b50, 4);
+        put_le(out_, z64 ? 45 : 20, 2);
+        put_le(out_, 0x0808, 2); // bit 3: crc in data descriptor, bit 11: UTF-8 name
+        put_le(out_, 0, 2);      // stored
+        put_le(out_, e.dos_time, 2);
+        put_le(out_, e.dos_date, 2);
+        put_le(out_, 0, 4);
+        put_le(out_, z64 ? 0xFFFFFFFFu : e.size, 4);
+        put_le(out_, z64 ? 0xFFFFFFFFu : e.size, 4);
+        put_le(out_, e.name.size(), 2);
+        put_le(out_, z64 ? 20 : 0, 2);
+        out_ += e.name;
+        if (z64) {
+            put_le(out_, 0x0001, 2);
+            put_le(out_, 16, 2);
+            put_le(out_, e.size, 8);
+            put_le(out_, e.size, 8);
+        }
+    }
+    void central_header(const ZipEntry &e) {
+        if (!e.written) return;
+        bool big = needs_zip64(e), far = e.offset >= 0xFFFFFFFFu;
+        std::string extra;
+        if (big) { put_le(extra, e.size, 8); put_le(extra, e.size, 8); }
+        if (far) put_le(extra, e.offset, 8);
+        put_le(out_, 0x02014b50, 4);
+        put_le(out_, (3 << 8) | 45, 2); // made by: unix
+        put_le(out_, big || far ? 45 : 20, 2);
+        put_le(out_, 0x0808, 2);
+        put_le(out_, 0, 2);
+        put_le(out_, e.dos_time, 2);
+        put_le(out_, e.dos_date, 2);
+        put_le(out_, e.crc, 4);
+        put_le(out_, big ? 0xFFFFFFFFu : e.size, 4);
+        put_le(out_, big ? 0xFFFFFFFFu : e.size, 4);
+        put_le(out_, e.name.size(), 2);
+        put_le(out_, extra.empty() ? 0 : extra.size() + 4, 2);
+        put_le(out_, 0, 2);               // comment
+        put_le(out_, 0, 2);               // disk
+        put_le(out_, 0, 2);               // internal attributes
+        put_le(out_, 0100644u << 16, 4);  // external: -rw-r--r--
+        put_le(out_, far ? 0xFFFFFFFFu : e.offset, 4);
+        out_ += e.name;
+        if (!extra.empty()) {
+            put_le(out_, 0x0001, 2);
+            put_le(out_, extra.size(), 2);
+            out_ += extra;
+        }
+        ++count_;
+    }
+    void end_records() {
+        uint64_t cd_size = offset_ - cd_offset_;
+        if (count_ >= 0xFFFF || cd_size >= 0xFFFFFFFFu || cd_offset_ >= 0xFFFFFFFFu) {
+            uint64_t z64_offset = offset_;
+            put_le(out_, 0x06064b50, 4);
+            put_le(out_, 44, 8);
+            put_le(out_, (3 << 8) | 45, 2);
+            put_le(out_, 45, 2);
+            put_le(out_, 0, 4);
+            put_le(out_, 0, 4);
+            put_le(out_, count_, 8);
+            put_le(out_, count_, 8);
+            put_le(out_, cd_size, 8);
+            put_le(out_, cd_offset_, 8);
+            put_le(out_, 0x07064b50, 4);
+            put_le(out_, 0, 4);
+            put_le(out_, z64_offset, 8);
+            put_le(out_, 1, 4);
+        }
+        put_le(out_, 0x06054b50, 4);
+        put_le(out_, 0, 2);
+        put_le(out_, 0, 2);
+        put_le(out_, std::min<uint64_t>(count_, 0xFFFF), 2);
+        put_le(out_, std::min<uint64_t>(count_, 0xFFFF), 2);
+        put_le(out_, std::min<uint64_t>(cd_size, 0xFFFFFFFFu), 4);
+        put_le(out_, std::min<uint64_t>(cd_offset_, 0xFFFFFFFFu), 4);
+        put_le(out_, 0, 2);
+    }
+    std::vector<ZipEntry> entries_;
+    std::string out_;
+    int fd_ = -1;
+    size_t cur_ = 0, cd_ = 0;
+    uint64_t count_ = 0, left_ = 0, offset_ = 0, cd_offset_ = 0;
+    uLong crc_ = 0;
+};
+// originals of clean photos for /api/export: one date (visibility as in write_blocks) or a list of ids
+// (personal ones only for their owner, as /images); "<date>/<name>", made unique
+static std::vector<ZipEntry> collect_export(AppContext &ctx, const std::string &date, const std::vector<std::string> &ids,
+                                            const std::string &scope, const std::string &username) {
+    PhaseTimer timer(kPhaseDb);
+    std::vector<ZipEntry> out;
+    std::set<std::string> names;
+    const char *cols = "SELECT owner,scope,date,orig_filename,storage_path,scan_status FROM photos ";
+    auto take = [&](sqlite3_stmt *st) {
+        while (sqlite3_step(st) == SQLITE_ROW) {
+            auto col = [&](int i) { const unsigned char *t = sqlite3_column_text(st, i); return t ? std::string((const char*)t) : std::string(); };
+            if (col(1) == "personal" && (username.empty() || col(0) != username)) continue;
+            if (col(5) != "clean") continue;
+            ZipEntry e;
+            if (!zip_entry_from_file(e, col(4))) continue;
+            std::string base = zip_entry_name(col(3)), name = col(2) + "/" + base;
+            size_t dot = base.find_last_of('.');
+            for (int n = 2; !names.insert(name).second; ++n)
+                name = col(2) + "/" + (dot == std::string::npos ? base + " (" + std::to_string(n) + ")"
+                                                               : base.substr(0, dot) + " (" + std::to_string(n) + ")" + base.substr(dot));
+            e.name = name;
+            out.push_back(std::move(e));
+        }
+    };
+    if (!date.empty()) {
+        sqlite3_stmt *st = nullptr;
+        std::string sql = std::string(cols) + "WHERE date=? AND (scope=? OR (scope='personal' AND owner=?)) ORDER BY created_at;";
+        if (sqlite3_prepare_v2(ctx.db, sql.c_str(), -1, &st, NULL) != SQLITE_OK) return out;
+        sqlite3_bind_text(st, 1, date.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(st, 2, scope == "personal" ? "" : "shared", -1, SQLITE_STATIC);
+        sqlite3_bind_text(st, 3, scope == "personal" ? username.c_str() : "", -1, SQLITE_TRANSIENT);
+        take(st);
+        sqlite3_finalize(st);
+        return out;
+    }
+    for (size_t i = 0; i < ids.size(); i += 500) {
+        size_t n = std::min(ids.size() - i, (size_t)500);
+        std::string sql = std::string(cols) + "WHERE id IN (";
+        for (size_t k = 0; k < n; ++k) sql += (k ? ",?" : "?");
+        sql += ") ORDER BY date DESC, created_at;";
+        sqlite3_stmt *st = nullptr;
+        if (sqlite3_prepare_v2(ctx.db, sql.c_str(), -1, &st, NULL) != SQLITE_OK) break;
+        for (size_t k = 0; k < n; ++k) sqlite3_bind_text(st, (int)k + 1, ids[i + k].c_str(), -1, SQLITE_TRANSIENT);
+        take(st);
+        sqlite3_finalize(st);
+    }
+    return out;
+}
+
+// --- near-duplicate index over photos.phash ---
+// Hamming distances from q to a run of hashes: AVX-512 VPOPCNTDQ (eight 64-bit popcounts per
+// instruction) where the CPU has it, else the POPCNT instruction; picked once at first use
+#define HAMMING_RUN_BODY for (; i < n; ++i) dist[i] = (uint8_t)__builtin_popcountll(h[i] ^ q);
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void hamming_run_vpopcnt(const uint64_t *h, size_t n, uint64_t q, uint8_t *dist) {
+    const __m512i vq = _mm512_set1_epi64((long long)q);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i c = _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512((const void*)(h + i)), vq));
+        _mm512_mask_cvtepi64_storeu_epi8(dist + i, 0xFF, c);
+    }
+    HAMMING_RUN_BODY
+}
+__attribute__((target("popcnt")))
+static void hamming_run_popcnt(const uint64_t *h, size_t n, uint64_t q, uint8_t *dist) { size_t i = 0; HAMMING_RUN_BODY }
+#endif
+static void hamming_run_generic(const uint64_t *h, size_t n, uint64_t q, uint8_t *dist) { size_t i = 0; HAMMING_RUN_BODY }
+static void hamming_run(const uint64_t *h, size_t n, uint64_t q, uint8_t *dist) {
+    using Fn = void (*)(const uint64_t *, size_t, uint64_t, uint8_t *);
+    static const Fn impl = [] {
+#if defined(__x86_64__) && defined(__GNUC__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512vpopcntdq")) return (Fn)hamming_run_vpopcnt;
+        if (__builtin_cpu_supports("popcnt")) return (Fn)hamming_run_popcnt;
+#endif
+        return (Fn)hamming_run_generic;
+    }();
+    impl(h, n, q, dist);
+}
+// Multi-index hashing: each hash is filed under its four 16-bit chunks. Two hashes within distance d
+// agree to within d/4 bits on at least one chunk, so a lookup only scans the buckets of the chunk
+// values within that radius (1 + 16 + 120 buckets per chunk for d <= 11) instead of every photo.
+// Buckets keep the hashes themselves contiguous, so checking one is a straight popcount run.
+// Rebuilt from the DB when the change log has moved on; uploads since then sit in a small delta list.
+class PhashIndex {
+public:
+    static constexpr int kMaxDistance = 11;
+    // forces the next refresh() to rebuild from the table (for changes the log does not show)
+    void invalidate() { std::unique_lock<std::shared_mutex> lk(mu_); built_seq_ = -1; }
+    // brings the index up to the change log. New changes are applied as a delta: photos added or
+    // updated since the build go to delta_, the table entries they replace are marked dead. Once the
+    // delta outgrows kMinDelta or an eighth of the table (or after invalidate()) the tables are
+    // rebuilt. Rows are read and sorted without holding mu_; lookups only wait for the swap.
+    void refresh(sqlite3 *db) {
+        std::lock_guard<std::mutex> one(refresh_m_);
+        long long lo = 0, hi = 0;
+        change_log_bounds(db, lo, hi); // read first: anything logged after it is applied next time
+        long long built;
+        size_t limit;
+        {
+            std::shared_lock<std::shared_mutex> lk(mu_);
+            built = built_seq_;
+            limit = std::max(kMinDelta, ids_.size() / 8);
+            if (delta_.size() + dead_count_ >= limit) built = -1;
+        }
+        if (hi == built) return;
+        // the log still reaches back to the build: apply what happened since
+        if (built >= 0 && built < hi && built + 1 >= lo && apply_changes(db, built, hi, limit)) return;
+        rebuild(db, hi);
+    }
+    // a photo inserted after the last refresh (visible to lookups right away)
+    void add(const std::string &id, uint64_t hash, const std::string &scope, const std::string &owner) {
+        uint32_t v = vis_key(scope, owner);
+        std::unique_lock<std::shared_mutex> lk(mu_);
+        auto it = pos_.find(id);
+        if (it != pos_.end() && !dead_[it->second]) return;
+        for (const auto &e : delta_) if (e.id == id) return;
+        delta_.push_back({ id, hash, v });
+    }
+    // ids of photos visible under (scope, owner) within distance d of hash, except `self`
+    std::vector<std::string> near(uint64_t hash, const std::string &scope, const std::string &owner, int d, const std::string &self) {
+        std::vector<std::string> out;
+        uint32_t v;
+        if (!find_vis(scope, owner, v)) return out;
+        std::shared_lock<std::shared_mutex> lk(mu_);
+        // before the first refresh() only the delta is there
+        if (!off_[0].empty()) {
+            std::vector<uint32_t> hits;
+            probe(hash, v, d, hits);
+            std::sort(hits.begin(), hits.end());
+            hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
+            for (uint32_t i : hits) if (ids_[i] != self) out.push_back(ids_[i]);
+        }
+        for (const auto &e : delta_)
+            if (e.vis == v && e.id != self && __builtin_popcountll(e.hash ^ hash) <= d) out.push_back(e.id);
+        return out;
+    }
+    // groups (two or more photos) of transitively near-identical photos visible under (scope, owner),
+    // largest first; call refresh() before
+    std::vector<std::vector<std::string>> clusters(const std::string &scope, const std::string &owner, int d) {
+        std::vector<std::vector<std::string>> out;
+        uint32_t v;
+        if (!find_vis(scope, owner, v)) return out;
+        std::shared_lock<std::shared_mutex> lk(mu_);
+        if (off_[0].empty()) return out;
+        // nodes: table entries 0..n-1, then the delta
+        const size_t n = hashes_.size(), total = n + delta_.size();
+        std::vector<uint32_t> parent(total);
+        for (size_t i = 0; i < parent.size(); ++i) parent[i] = (uint32_t)i;
+        auto find = [&](uint32_t x) { while (parent[x] != x) x = parent[x] = parent[parent[x]]; return x; };
+        auto unite = [&](uint32_t i, uint32_t j) {
+            uint32_t ri = find(i), rj = find(j);
+            if (ri != rj) parent[std::max(ri, rj)] = std::min(ri, rj);
+        };
+        auto live = [&](uint32_t i) { return vis_[i] == v && !dead_[i]; };
+        // instead of probing per photo (random bucket reads), join every bucket with the buckets
+        // within the chunk radius, walking each table in order; each bucket pair is visited once
+        std::vector<uint8_t> dist;
+        for (int k = 0; k < 4; ++k) {
+            for (uint32_t a = 0; a < 65536; ++a) {
+                const size_t as = off_[k][a], an = off_[k][a + 1] - as;
+                if (!an) continue;
+                for (uint32_t mask : masks(d / 4)) {
+                    const uint32_t b = a ^ mask;
+                    if (b < a) continue;
+                    const size_t bs = off_[k][b], bn = off_[k][b + 1] - bs;
+                    if (!bn) continue;
+                    if (dist.size() < bn) dist.resize(bn);
+                    for (size_t x = 0; x < an; ++x) {
+                        const uint32_t i = ti_[k][as + x];
+                        if (!live(i)) continue;
+                        // same bucket: only the entries after x
+                        const size_t from = b == a ? x + 1 : 0;
+                        if (from >= bn) continue;
+                        hamming_run(&th_[k][bs + from], bn - from, th_[k][as + x], dist.data());
+                        for (size_t y = 0; y < bn - from; ++y) {
+                            if (dist[y] > d) continue;
+                            const uint32_t j = ti_[k][bs + from + y];
+                            if (live(j)) unite(i, j);
+                        }
+                    }
+                }
+            }
+        }
+        // the delta (small): probed against the tables and compared with each other
+        for (size_t x = 0; x < delta_.size(); ++x) {
+            const Delta &e = delta_[x];
+            if (e.vis != v) continue;
+            std::vector<uint32_t> hits;
+            probe(e.hash, v, d, hits);
+            for (uint32_t i : hits) unite((uint32_t)(n + x), i);
+            for (size_t y = x + 1; y < delta_.size(); ++y)
+                if (delta_[y].vis == v && __builtin_popcountll(delta_[y].hash ^ e.hash) <= d) unite((uint32_t)(n + x), (uint32_t)(n + y));
+        }
+        auto member = [&](size_t i) { return i < n ? live((uint32_t)i) : delta_[i - n].vis == v; };
+        auto id_of = [&](size_t i) -> const std::string & { return i < n ? ids_[i] : delta_[i - n].id; };
+        std::vector<uint32_t> size(total, 0);
+        for (size_t i = 0; i < total; ++i) if (member(i)) ++size[find((uint32_t)i)];
+        std::unordered_map<uint32_t, size_t> slot; // root -> index in out
+        for (size_t i = 0; i < total; ++i) {
+            if (!member(i)) continue;
+            uint32_t r = find((uint32_t)i);
+            if (size[r] < 2) continue;
+            auto it = slot.emplace(r, out.size()).first;
+            if (it->second == out.size()) out.emplace_back();
+            out[it->second].push_back(id_of(i));
+        }
+        std::sort(out.begin(), out.end(), [](const std::vector<std::string> &a, const std::vector<std::string> &b) {
+            return a.size() != b.size() ? a.size() > b.size() : a.front() < b.front();
+        });
+        return out;
+    }
+private:
+    struct Delta { std::string id; uint64_t hash; uint32_t vis; };
+    static constexpr size_t kMinDelta = 4096;
+    static uint32_t chunk(uint64_t h, int k) { return (uint32_t)(h >> (16 * k)) & 0xFFFF; }
+    // visibility classes as in write_blocks: all shared photos, or one owner's personal ones.
+    // Numbers are never reused, so a rebuild can assign them without holding mu_.
+    static std::string vis_name(const std::string &scope, const std::string &owner) { return scope == "shared" ? std::string() : "p:" + owner; }
+    uint32_t vis_key(const std::string &scope, const std::string &owner) {
+        std::lock_guard<std::mutex> lk(owners_m_);
+        return owners_.emplace(vis_name(scope, owner), (uint32_t)owners_.size()).first->second;
+    }
+    bool find_vis(const std::string &scope, const std::string &owner, uint32_t &v) {
+        std::lock_guard<std::mutex> lk(owners_m_);
+        auto it = owners_.find(vis_name(scope, owner));
+        if (it == owners_.end()) return false;
+        v = it->second;
+        return true;
+    }
+    // changes in (since, hi], folded into the delta; false (nothing applied) when there are too many
+    bool apply_changes(sqlite3 *db, long long since, long long hi, size_t limit) {
+        struct Row { bool keep; uint64_t hash; uint32_t vis; };
+        std::unordered_map<std::string, Row> rows; // current state of each photo touched
+        sqlite3_stmt *st = nullptr;
+        const char *sql = "SELECT c.photo_id,p.phash,p.scope,p.owner FROM changes c "
+                          "LEFT JOIN photos p ON p.id=c.photo_id AND p.phash IS NOT NULL AND p.scan_status='clean' "
+                          "WHERE c.seq > ? AND c.seq <= ? LIMIT ?;";
+        if (sqlite3_prepare_v2(db, sql, -1, &st, NULL) != SQLITE_OK) return false;
+        sqlite3_bind_int64(st, 1, since);
+        sqlite3_bind_int64(st, 2, hi);
+        sqlite3_bind_int64(st, 3, (sqlite3_int64)limit + 1);
+        size_t count = 0;
+        while (sqlite3_step(st) == SQLITE_ROW) {
+            ++count;
+            Row r{ sqlite3_column_type(st, 1) != SQLITE_NULL, 0, 0 };
+            if (r.keep) {
+                const unsigned char *scope = sqlite3_column_text(st, 2), *owner = sqlite3_column_text(st, 3);
+                r.hash = (uint64_t)sqlite3_column_int64(st, 1);
+                r.vis = vis_key(scope ? (const char*)scope : "", owner ? (const char*)owner : "");
+            }
+            rows[(const char*)sqlite3_column_text(st, 0)] = r;
+        }
+        sqlite3_finalize(st);
+        if (count > limit) return false;
+        std::unique_lock<std::shared_mutex> lk(mu_);
+        delta_.erase(std::remove_if(delta_.begin(), delta_.end(), [&](const Delta &e) { return rows.count(e.id) != 0; }), delta_.end());
+        for (const auto &r : rows) {
+            auto it = pos_.find(r.first);
+            if (it != pos_.end() && !dead_[it->second]) {
+                const uint32_t i = it->second;
+                if (r.second.keep && hashes_[i] == r.second.hash && vis_[i] == r.second.vis) continue; // unchanged
+                dead_[i] = 1;
+                ++dead_count_;
+            }
+            if (r.second.keep) delta_.push_back({ r.first, r.second.hash, r.second.vis });
+        }
+        built_seq_ = hi;
+        return true;
+    }
+    // full build into fresh tables, swapped in at the end; a failed read keeps the old build
+    void rebuild(sqlite3 *db, long long hi) {
+        std::vector<std::string> ids;
+        std::vector<uint64_t> hashes;
+        std::vector<uint32_t> vis, off[4], ti[4];
+        std::vector<uint64_t> th[4];
+        sqlite3_stmt *st = nullptr;
+        if (sqlite3_prepare_v2(db, "SELECT id,phash,scope,owner FROM photos WHERE phash IS NOT NULL AND scan_status='clean';", -1, &st, NULL) != SQLITE_OK) return;
+        bool ok = true;
+        for (int rc; (rc = sqlite3_step(st)) != SQLITE_DONE; ) {
+            if (rc != SQLITE_ROW) { ok = false; break; }
+            const unsigned char *scope = sqlite3_column_text(st, 2), *owner = sqlite3_column_text(st, 3);
+            ids.push_back((const char*)sqlite3_column_text(st, 0));
+            hashes.push_back((uint64_t)sqlite3_column_int64(st, 1));
+            vis.push_back(vis_key(scope ? (const char*)scope : "", owner ? (const char*)owner : ""));
+        }
+        sqlite3_finalize(st);
+        if (!ok) return;
+        // counting sort by each chunk: off[k][v]..off[k][v+1] is the bucket for chunk value v
+        const size_t n = hashes.size();
+        for (int k = 0; k < 4; ++k) {
+            off[k].assign(65537, 0);
+            for (uint64_t h : hashes) ++off[k][chunk(h, k) + 1];
+            for (size_t v = 0; v < 65536; ++v) off[k][v + 1] += off[k][v];
+            std::vector<uint32_t> fill(off[k].begin(), off[k].end() - 1);
+            th[k].resize(n);
+            ti[k].resize(n);
+            for (size_t i = 0; i < n; ++i) {
+                uint32_t at = fill[chunk(hashes[i], k)]++;
+                th[k][at] = hashes[i];
+                ti[k][at] = (uint32_t)i;
+            }
+        }
+        std::unordered_map<std::string, uint32_t> pos;
+        pos.reserve(n);
+        for (size_t i = 0; i < n; ++i) pos.emplace(ids[i], (uint32_t)i);
+        std::unique_lock<std::shared_mutex> lk(mu_);
+        ids_.swap(ids); hashes_.swap(hashes); vis_.swap(vis); pos_.swap(pos);
+        for (int k = 0; k < 4; ++k) { off_[k].swap(off[k]); ti_[k].swap(ti[k]); th_[k].swap(th[k]); }
+        dead_.assign(n, 0);
+        dead_count_ = 0;
+        // add() calls for photos the read already saw are in the tables now
+        delta_.erase(std::remove_if(delta_.begin(), delta_.end(), [&](const Delta &e) { return pos_.count(e.id) != 0; }), delta_.end());
+        built_seq_ = hi;
+        lk.unlock(); // the old tables are freed outside the lock
+    }
+    // 16-bit masks with at most r bits set (r = 0..2)
+    static const std::vector<uint32_t> &masks(int r) {
+        static const std::vector<uint32_t> m[3] = { build_masks(0), build_masks(1), build_masks(2) };
+        return m[r];
+    }
+    static std::vector<uint32_t> build_masks(int r) {
+        std::vector<uint32_t> out;
+        for (uint32_t x = 0; x < 65536; ++x) if (__builtin_popcount(x) <= r) out.push_back(x);
+        return out;
+    }
+    void probe(uint64_t q, uint32_t v, int d, std::vector<uint32_t> &hits) const {
+        thread_local std::vector<uint8_t> dist;
+        for (int k = 0; k < 4; ++k) {
+            const uint32_t key = chunk(q, k);
+            for (uint32_t mask : masks(d / 4)) {
+                const uint32_t bucket = key ^ mask;
+                const size_t s = off_[k][bucket], n = off_[k][bucket + 1] - s;
+                if (!n) continue;
+                if (dist.size() < n) dist.resize(n);
+                hamming_run(&th_[k][s], n, q, dist.data());
+                for (size_t i = 0; i < n; ++i) {
+                    const uint32_t at = ti_[k][s + i];
+                    if (dist[i] <= d && vis_[at] == v && !dead_[at]) hits.push_back(at);
+                }
+            }
+        }
+    }
+    std::mutex refresh_m_;  // one refresh at a time
+    std::shared_mutex mu_;  // tables, delta_ and built_seq_
+    long long built_seq_ = -1;
+    std::vector<std::string> ids_;
+    std::vector<uint64_t> hashes_;
+    std::vector<uint32_t> vis_;
+    std::unordered_map<std::string, uint32_t> pos_; // id -> table entry
+    std::vector<uint8_t> dead_;                     // entries removed or replaced since the build
+    size_t dead_count_ = 0;
+    std::vector<uint32_t> off_[4], ti_[4];
+    std::vector<uint64_t> th_[4];
+    std::vector<Delta> delta_;
+    std::mutex owners_m_;
+    std::unordered_map<std::string, uint32_t> owners_;
+};
+// builds the index from the hashes already stored, then hashes photos stored before hashing existed
+// (or whose hash failed) from their originals, niced, and rebuilds it once they are in
+static void phash_backfill(AppContext ctx) {
+    ctx.phashes->refresh(ctx.db);
+    std::vector<std::pair<std::string, std::string>> todo;
+    sqlite3_stmt *st = nullptr;
+    if (sqlite3_prepare_v2(ctx.db, "SELECT id,storage_path FROM photos WHERE phash IS NULL AND scan_status='clean';", -1, &st, NULL) == SQLITE_OK) {
+        while (sqlite3_step(st) == SQLITE_ROW)
+            todo.push_back({ (const char*)sqlite3_column_text(st, 0), (const char*)sqlite3_column_text(st, 1) });
+    }
+    sqlite3_finalize(st);
+    if (!todo.empty()) std::cout << "Perceptual hashes: " << todo.size() << " photos to hash" << std::endl;
+    size_t done = 0;
+    for (const auto &t : todo) {
+        uint64_t h;
+        if (!compute_dhash(t.second, h)) continue;
+        if (sqlite3_prepare_v2(ctx.db, "UPDATE photos SET phash=? WHERE id=?;", -1, &st, NULL) == SQLITE_OK) {
+            sqlite3_bind_int64(st, 1, (sqlite3_int64)h);
+            sqlite3_bind_text(st, 2, t.first.c_str(), -1, SQLITE_TRANSIENT);
+            if (sqlite3_step(st) == SQLITE_DONE) ++done;
+        }
+        sqlite3_finalize(st);
+    }
+    if (done) ctx.phashes->invalidate(); // phash updates are not in the change log
+    ctx.phashes->refresh(ctx.db);
+}
+
+// bytes of [off, off+len) of fd that are already in the page cache
+static uint64_t resident_bytes(int fd, uint64_t off, uint64_t len) {
+    static const uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = off & ~(page - 1);
+    size_t map_len = (size_t)(off + len - start);
+    void *p = mmap(nullptr, map_len, PROT_READ, MAP_SHARED, fd, (off_t)start);
+    if (p == MAP_FAILED) return 0;
+    std::vector<unsigned char> vec((map_len + page - 1) / page);
+    uint64_t n = 0;
+    if (mincore(p, map_len, vec.data()) == 0)
+        for (unsigned char v : vec) n += (v & 1) ? page : 0;
+    munmap(p, map_len);
+    return std::min(n, len);
+}
+// After a restart the first /api/blocks pages would read every thumbnail from a cold disk. This
+// reads ahead the thumbnails (every stored variant, packed or loose) and the metadata files
+// (/api/photo) of the newest warmup_dates dates per scope and owner, newest first; planning them runs the same date/photo lookups as
+// /api/blocks, which brings those rows into the page cache too. Pages already cached are skipped
+// (mincore), the thread runs at idle I/O priority and is held to warmup_mb_per_second.
+static void warmup_worker(AppContext ctx) {
+    Warmup &w = *ctx.warmup;
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, 3 << 13 /* IOPRIO_CLASS_IDLE */);
+    auto now_ms = [] {
+        return (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    };
+    w.started_ms = now_ms();
+    w.state = 1;
+    sqlite3 *db = open_db_connection(ctx.cfg);
+    // loose files are opened only while their range is read, so the plan holds no descriptors
+    struct Range { int fd; std::shared_ptr<PackSegment> seg; std::string path; uint64_t off, len; };
+    std::vector<Range> ranges;
+    auto ids = std::make_unique<std::unordered_set<std::string>>();
+    sqlite3_stmt *sd = nullptr, *sp = nullptr;
+    const char *sql_dates = "SELECT scope, owner, date FROM (SELECT scope, owner, date, "
+                            "ROW_NUMBER() OVER (PARTITION BY scope, owner ORDER BY date DESC) AS r FROM photo_date_counts) "
+                            "WHERE r <= ? ORDER BY date DESC;";
+    const char *sql_ph = "SELECT id, thumb_path, meta_path FROM photos WHERE date=? AND scope=? AND COALESCE(owner,'')=? ORDER BY created_at DESC;";
+    if (db && sqlite3_prepare_v2(db, sql_dates, -1, &sd, NULL) == SQLITE_OK && sqlite3_prepare_v2(db, sql_ph, -1, &sp, NULL) == SQLITE_OK) {
+        std::vector<const char*> exts;
+        for (const auto &name : ctx.cfg.thumb_formats) if (const ThumbFormat *f = find_thumb_format(name)) exts.push_back(f->ext);
+        exts.push_back("jpg");
+        std::vector<std::pair<std::shared_ptr<PackSegment>, PackLoc>> locs;
+        sqlite3_bind_int(sd, 1, ctx.cfg.warmup_dates);
+        while (sqlite3_step(sd) == SQLITE_ROW) {
+            ++w.dates;
+            sqlite3_reset(sp);
+            sqlite3_bind_text(sp, 1, (const char*)sqlite3_column_text(sd, 2), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(sp, 2, (const char*)sqlite3_column_text(sd, 0), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(sp, 3, (const char*)sqlite3_column_text(sd, 1), -1, SQLITE_TRANSIENT);
+            while (sqlite3_step(sp) == SQLITE_ROW) {
+                std::string id = (const char*)sqlite3_column_text(sp, 0);
+                const char *tp = (const char*)sqlite3_column_text(sp, 1);
+                std::string thumb_path = tp ? tp : "";
+                ++w.photos;
+                for (const char *ext : exts) {
+                    PackLoc loc;
+                    if (ctx.thumbs && ctx.thumbs->find(thumb_key(id, ext), loc)) {
+                        if (auto seg = ctx.thumbs->segment(loc.segment)) locs.push_back({ seg, loc });
+                    } else if (!thumb_path.empty()) {
+                        std::string path = std::strcmp(ext, "jpg") == 0 ? thumb_path : thumb_variant_path(thumb_path, ext);
+                        struct stat st;
+                        if (stat(path.c_str(), &st) != 0 || st.st_size == 0) continue;
+                        ranges.push_back({ -1, nullptr, std::move(path), 0, (uint64_t)st.st_size });
+                    }
+                }
+                const char *mp = (const char*)sqlite3_column_text(sp, 2);
+                struct stat st;
+                if (mp && *mp && stat(mp, &st) == 0 && st.st_size > 0) ranges.push_back({ -1, nullptr, mp, 0, (uint64_t)st.st_size });
+                ids->insert(std::move(id));
+            }
+        }
+        // pack records of one date usually sit close together: merge neighbours into larger reads
+        std::sort(locs.begin(), locs.end(), [](const auto &a, const auto &b) {
+            return a.second.segment != b.second.segment ? a.second.segment > b.second.segment : a.second.offset > b.second.offset;
+        });
+        for (const auto &l : locs) {
+            Range *last = ranges.empty() ? nullptr : &ranges.back();
+            if (last && last->seg == l.first && l.second.offset + l.second.length + (64 << 10) >= last->off) {
+                uint64_t end = last->off + last->len;
+                last->off = std::min(last->off, l.second.offset);
+                last->len = end - last->off;
+            } else {
+                ranges.push_back({ l.first->fd, l.first, std::string(), l.second.offset, l.second.length });
+            }
+        }
+    }
+    sqlite3_finalize(sd);
+    sqlite3_finalize(sp);
+    if (db) sqlite3_close(db);
+    w.owned_ids = std::move(ids);
+    w.ids.store(w.owned_ids.get(), std::memory_order_release);
+    for (const auto &r : ranges) w.bytes += r.len;
+
+    const uint64_t chunk = 1 << 20, rate = (uint64_t)ctx.cfg.warmup_mb_per_second << 20;
+    auto t0 = std::chrono::steady_clock::now();
+    for (const auto &r : ranges) {
+        int fd = r.fd;
+        if (!r.path.empty() && (fd = ::open(r.path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+            w.bytes_done += r.len; // removed since planning
+            continue;
+        }
+        for (uint64_t off = r.off; off < r.off + r.len; off += chunk) {
+            uint64_t len = std::min(chunk, r.off + r.len - off);
+            uint64_t resident = resident_bytes(fd, off, len);
+            w.bytes_resident += resident;
+            if (resident < len) {
+                if (readahead(fd, (off64_t)off, (size_t)len) != 0) posix_fadvise(fd, (off_t)off, (off_t)len, POSIX_FADV_WILLNEED);
+                w.bytes_read += len - resident;
+                // stay at or below the budget: sleep until the bytes read so far are "paid for"
+                auto due = t0 + std::chrono::microseconds(w.bytes_read * 1000000 / rate);
+                std::this_thread::sleep_until(due);
+            }
+            w.bytes_done += len;
+        }
+        if (!r.path.empty()) close(fd);
+    }
+    w.finished_ms = now_ms();
+    w.state = 2;
+    std::cout << "Warmup: " << w.photos << " photos from " << w.dates << " dates, " << (w.bytes_read >> 20) << " MB read, "
+              << (w.bytes_resident >> 20) << " MB already cached, " << (w.finished_ms - w.started_ms) << " ms" << std::endl;
+}
+
+// --- read replicas ---
+// A follower (replica_of) keeps a copy of the primary: it tails /api/replication/changes, copies the
+// files of every added or updated photo into its own storage_root and then upserts the row, so its
+// /api/blocks, /thumbs and /images never point at a file that is not there yet. Writes are replayed
+// on the primary (see proxy_to_primary). Seqs are the primary's; the follower's own change log
+// (triggers) keeps feeding its /api/changes and /api/events.
+
+// relative path that stays below whatever root it is joined to
+static bool safe_relative_path(const std::string &rel) {
+    if (rel.empty() || rel[0] == '/') return false;
+    size_t pos = 0;
+    while (pos <= rel.size()) {
+        size_t q = rel.find('/', pos);
+        if (q == std::string::npos) q = rel.size();
+        std::string part = rel.substr(pos, q - pos);
+        if (part.empty() || part == "." || part == "..") return false;
+        pos = q + 1;
+    }
+    return true;
+}
+// path below storage_root, "" for files outside it (those are not replicated)
+static std::string storage_relative(const Config &cfg, const std::string &path) {
+    std::string root = cfg.storage_root + "/";
+    if (path.compare(0, root.size(), root) != 0) return {};
+    std::string rel = path.substr(root.size());
+    return safe_relative_path(rel) ? rel : std::string();
+}
+// "jpg" or a known variant; anything else is not a thumbnail encoding
+static const char *thumb_ext(const std::string &ext) {
+    if (ext == "jpg") return "jpg";
+    const ThumbFormat *f = find_thumb_format(ext);
+    return f ? f->ext : nullptr;
+}
+static std::string loose_thumb_path(const std::string &thumb_path, const char *ext) {
+    return std::strcmp(ext, "jpg") == 0 ? thumb_path : thumb_variant_path(thumb_path, ext);
+}
+static bool has_stored_thumb(const AppContext &ctx, const std::string &id, const std::string &thumb_path, const char *ext) {
+    PackLoc loc;
+    if (ctx.thumbs && ctx.thumbs->find(thumb_key(id, ext), loc)) return true;
+    return !thumb_path.empty() && access(loose_thumb_path(thumb_path, ext).c_str(), R_OK) == 0;
+}
+static bool read_stored_thumb(const AppContext &ctx, const std::string &id, const std::string &thumb_path, const char *ext, std::string &out) {
+    PackLoc loc;
+    if (ctx.thumbs && ctx.thumbs->find(thumb_key(id, ext), loc)) return ctx.thumbs->read(thumb_key(id, ext), loc, out);
+    if (thumb_path.empty()) return false;
+    out = read_file_binary(loose_thumb_path(thumb_path, ext));
+    return !out.empty();
+}
+
+// one photo for a follower, read in place from the statement starting at `c` (kReplicaColumns order).
+// Paths are relative to storage_root; "thumbs" lists the encodings stored right now. Files of photos
+// that are not clean are never offered, the follower gets them with the update that publishes them.
+static const char *const kReplicaColumns =
+    "p.id,p.owner,p.scope,p.date,p.orig_filename,p.created_at,p.placeholder,p.scan_status,p.thumb_formats,p.phash,"
+    "p.storage_path,p.meta_path,p.thumb_path";
+static void write_replica_photo(const AppContext &ctx, JsonWriter &w, sqlite3_stmt *st, int c) {
+    auto text = [&](int i) { const unsigned char *t = sqlite3_column_text(st, c + i); return t ? std::string((const char*)t) : std::string(); };
+    std::string id = text(0), scan = text(7), thumb_path = text(12);
+    bool clean = scan == "clean";
+    w.begin_object();
+    w.key("id").value(id);
+    w.key("owner").value(sqlite3_column_text(st, c + 1));
+    w.key("scope").value(sqlite3_column_text(st, c + 2));
+    w.key("date").value(sqlite3_column_text(st, c + 3));
+    w.key("orig_filename").value(sqlite3_column_text(st, c + 4));
+    w.key("created_at").value(sqlite3_column_text(st, c + 5));
+    w.key("placeholder").value(sqlite3_column_text(st, c + 6));
+    w.key("scan_status").value(scan);
+    w.key("thumb_formats").value(sqlite3_column_text(st, c + 8));
+    if (sqlite3_column_type(st, c + 9) == SQLITE_NULL) w.key("phash").null();
+    else w.key("phash").value((long long)sqlite3_column_int64(st, c + 9));
+    w.key("original").value(storage_relative(ctx.cfg, text(10)));
+    w.key("meta").value(storage_relative(ctx.cfg, text(11)));
+    w.key("thumb").value(storage_relative(ctx.cfg, thumb_path));
+    w.key("thumbs").begin_array();
+    if (clean) {
+        if (has_stored_thumb(ctx, id, thumb_path, "jpg")) w.value("jpg");
+        for (const auto &f : kThumbFormats) if (has_stored_thumb(ctx, id, thumb_path, f.ext)) w.value(f.ext);
+    }
+    w.end_array();
+    w.end_object();
+}
+// /api/replication/*: 404 unless replication_key is configured, 403 without the matching X-Replication-Key
+static bool replication_authorized(const Config &cfg, const Request &req, Response &res) {
+    if (cfg.replication_key.empty()) { res.status=404; res.set_content("{\"error\":\"replication_disabled\"}","application/json"); return false; }
+    std::string key = req.get_header_value("X-Replication-Key");
+    if (key.size() != cfg.replication_key.size() || CRYPTO_memcmp(key.data(), cfg.replication_key.data(), key.size()) != 0) {
+        res.status=403; res.set_content("{\"error\":\"forbidden\"}","application/json");
+        return false;
+    }
+    return true;
+}
+
+static long long wall_ms() {
+    return (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+static void replica_set_error(ReplicaState &rs, const std::string &err) {
+    std::lock_guard<std::mutex> lk(rs.m);
+    if (err != rs.last_error && !err.empty()) std::cerr << "Replica: " << err << std::endl;
+    rs.last_error = err;
+}
+// GET on the primary; false with the reason in err unless it answered 200 (status is 0 without an answer)
+static bool replica_get(Client &cli, const std::string &path, std::string &body, int &status, std::string &err) {
+    auto r = cli.Get(path);
+    if (!r) { status = 0; err = "primary unreachable (" + to_string(r.error()) + ")"; return false; }
+    status = r->status;
+    if (r->status != 200) { err = "primary answered " + std::to_string(r->status) + " for " + path.substr(0, path.find('?')); return false; }
+    body = std::move(r->body);
+    return true;
+}
+// fetched into a temp name and renamed, so a half-copied file is never served
+static bool replica_fetch_file(AppContext &ctx, Client &cli, const std::string &id, const std::string &query,
+                               std::string &data, bool &missing, std::string &err) {
+    int status = 0;
+    missing = false;
+    if (replica_get(cli, "/api/replication/file/" + id + "?" + query, data, status, err)) {
+        ctx.replica->files_fetched.fetch_add(1, std::memory_order_relaxed);
+        ctx.replica->bytes_fetched.fetch_add(data.size(), std::memory_order_relaxed);
+        return true;
+    }
+    // gone on the primary meanwhile: its delete is further down the log
+    if (status == 404) { missing = true; return true; }
+    return false;
+}
+static bool replica_store_file(const std::string &path, const std::string &data) {
+    size_t slash = path.find_last_of('/');
+    if (slash != std::string::npos) ensure_dir(path.substr(0, slash));
+    std::string tmp = path + ".part";
+    if (!write_file_binary(tmp, data)) return false;
+    chmod(tmp.c_str(), 0640);
+    if (rename(tmp.c_str(), path.c_str()) != 0) { unlink(tmp.c_str()); return false; }
+    return true;
+}
+// copies whatever files of `p` are missing locally, then inserts or updates its row
+static bool replica_apply_photo(AppContext &ctx, Client &cli, const json &p, std::string &err) {
+    auto str = [&](const char *k) { auto it = p.find(k); return it != p.end() && it->is_string() ? it->get<std::string>() : std::string(); };
+    std::string id = str("id");
+    if (id.empty() || id.find_first_not_of("0123456789abcdefABCDEF-") != std::string::npos) { err = "bad photo id from primary"; return false; }
+    auto local = [&](const char *k) {
+        std::string rel = str(k);
+        return safe_relative_path(rel) ? ctx.cfg.storage_root + "/" + rel : std::string();
+    };
+    std::string storage_path = local("original"), meta_path = local("meta"), thumb_path = local("thumb");
+    std::string scan_status = str("scan_status");
+    if (scan_status == "clean") {
+        std::string data;
+        bool missing;
+        for (auto f : { std::make_pair(&storage_path, "original"), std::make_pair(&meta_path, "meta") }) {
+            if (f.first->empty() || access(f.first->c_str(), F_OK) == 0) continue;
+            if (!replica_fetch_file(ctx, cli, id, std::string("kind=") + f.second, data, missing, err)) return false;
+            if (!missing && !replica_store_file(*f.first, data)) { err = "cannot write " + *f.first; return false; }
+        }
+        if (p.contains("thumbs") && p["thumbs"].is_array()) {
+            for (const auto &t : p["thumbs"]) {
+                const char *ext = t.is_string() ? thumb_ext(t.get<std::string>()) : nullptr;
+                if (!ext || has_stored_thumb(ctx, id, thumb_path, ext)) continue;
+                if (!replica_fetch_file(ctx, cli, id, std::string("kind=thumb&ext=") + ext, data, missing, err)) return false;
+                if (missing) continue;
+                bool ok = ctx.thumbs ? ctx.thumbs->put(thumb_key(id, ext), data)
+                                     : !thumb_path.empty() && replica_store_file(loose_thumb_path(thumb_path, ext), data);
+                if (!ok) { err = "cannot store thumbnail of " + id; return false; }
+            }
+        }
+    }
+    PhaseTimer timer(kPhaseDb);
+    const char *sql =
+        "INSERT INTO photos(id,owner,scope,date,orig_filename,storage_path,thumb_path,meta_path,created_at,placeholder,thumb_formats,scan_status,phash) "
+        "VALUES(?,?,?,?,?,?,?,?,?,?,?,?,?) ON CONFLICT(id) DO UPDATE SET owner=excluded.owner, scope=excluded.scope, date=excluded.date, "
+        "orig_filename=excluded.orig_filename, storage_path=excluded.storage_path, thumb_path=excluded.thumb_path, meta_path=excluded.meta_path, "
+        "created_at=excluded.created_at, placeholder=excluded.placeholder, thumb_formats=excluded.thumb_formats, "
+        "scan_status=excluded.scan_status, phash=excluded.phash;";
+    sqlite3_stmt *st = nullptr;
+    if (sqlite3_prepare_v2(ctx.db, sql, -1, &st, NULL) != SQLITE_OK) { err = sqlite3_errmsg(ctx.db); return false; }
+    auto bind = [&](int i, const std::string &v, bool null_if_empty) {
+        if (null_if_empty && v.empty()) sqlite3_bind_null(st, i);
+        else sqlite3_bind_text(st, i, v.c_str(), -1, SQLITE_TRANSIENT);
+    };
+    bind(1, id, false);
+    bind(2, str("owner"), false);
+    bind(3, str("scope"), false);
+    bind(4, str("date"), false);
+    bind(5, str("orig_filename"), false);
+    bind(6, storage_path, false);
+    bind(7, thumb_path, false);
+    bind(8, meta_path, false);
+    bind(9, str("created_at"), false);
+    bind(10, str("placeholder"), true);
+    bind(11, str("thumb_formats"), true);
+    bind(12, scan_status.empty() ? std::string("clean") : scan_status, false);
+    if (p.contains("phash") && p["phash"].is_number_integer()) sqlite3_bind_int64(st, 13, p["phash"].get<sqlite3_int64>());
+    else sqlite3_bind_null(st, 13);
+    bool ok = sqlite3_step(st) == SQLITE_DONE;
+    if (!ok) err = sqlite3_errmsg(ctx.db);
+    sqlite3_finalize(st);
+    if (!ok) return false;
+    ctx.replica->photos_applied.fetch_add(1, std::memory_order_relaxed);
+    notify_changes(ctx);
+    return true;
+}
+static bool replica_delete(AppContext &ctx, const std::vector<std::string> &ids, std::string &err) {
+    auto photos = lookup_photos(ctx, ids);
+    if (photos.empty() || delete_photos(ctx, photos)) return true;
+    err = "local delete failed";
+    return false;
+}
+static void replica_save_cursor(AppContext &ctx, long long seq) {
+    sqlite3_stmt *st = nullptr;
+    if (sqlite3_prepare_v2(ctx.db, "INSERT OR REPLACE INTO replication_state(key,value) VALUES('seq',?);", -1, &st, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(st, 1, std::to_string(seq).c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_step(st);
+    }
+    sqlite3_finalize(st);
+    ctx.replica->applied_seq = seq;
+    if (seq >= ctx.replica->primary_seq) ctx.replica->caught_up_ms = wall_ms();
+}
+// full copy: every photo of the primary (paged by id), then local photos it no longer has are
+// deleted. Streaming resumes from the head taken before the first page, so anything changed
+// while paging is applied again afterwards.
+static bool replica_snapshot(AppContext &ctx, Client &cli, long long &cursor, std::string &err) {
+    std::cout << "Replica: copying the library from " << ctx.cfg.replica_of << std::endl;
+    std::unordered_set<std::string> seen;
+    std::string after, body;
+    long long head = -1;
+    int status = 0;
+    for (;;) {
+        std::string path = "/api/replication/snapshot?limit=200&after=" + encode_query_component(after);
+        if (!replica_get(cli, path, body, status, err)) return false;
+        json j = json::parse(body, nullptr, false);
+        if (j.is_discarded() || !j.contains("photos")) { err = "bad snapshot page from primary"; return false; }
+        if (head < 0) {
+            head = j.value("head", 0LL);
+            ctx.replica->primary_seq = head;
+        }
+        for (const auto &p : j["photos"]) {
+            if (!replica_apply_photo(ctx, cli, p, err)) return false;
+            seen.insert(p.value("id", ""));
+        }
+        after = j.value("after", after);
+        if (!j.value("more", false)) break;
+    }
+    std::vector<std::string> stale;
+    sqlite3_stmt *st = nullptr;
+    if (sqlite3_prepare_v2(ctx.db, "SELECT id FROM photos;", -1, &st, NULL) == SQLITE_OK) {
+        while (sqlite3_step(st) == SQLITE_ROW) {
+            std::string id = (const char*)sqlite3_column_text(st, 0);
+            if (!seen.count(id)) stale.push_back(std::move(id));
+        }
+    }
+    sqlite3_finalize(st);
+    for (size_t i = 0; i < stale.size(); i += 200) {
+        std::vector<std::string> batch(stale.begin() + i, stale.begin() + std::min(stale.size(), i + 200));
+        if (!replica_delete(ctx, batch, err)) return false;
+    }
+    ctx.phashes->invalidate();
+    std::cout << "Replica: " << seen.size() << " photos copied, " << stale.size() << " removed, following from seq " << head << std::endl;
+    cursor = head;
+    replica_save_cursor(ctx, cursor);
+    return true;
+}
+// one page of changes, long-polled for `wait` seconds; the cursor is saved after every page (and
+// before a failing change)
+static bool replica_pull(AppContext &ctx, Client &cli, long long &cursor, int wait, std::string &err) {
+    std::string body;
+    int status = 0;
+    std::string path = "/api/replication/changes?limit=200&wait=" + std::to_string(wait) + "&since=" + std::to_string(cursor);
+    if (!replica_get(cli, path, body, status, err)) {
+        if (status != 410) return false;
+        std::cout << "Replica: seq " << cursor << " is no longer in the primary's change log, copying again" << std::endl;
+        cursor = -1;
+        return true;
+    }
+    json j = json::parse(body, nullptr, false);
+    if (j.is_discarded() || !j.contains("changes")) { err = "bad change page from primary"; return false; }
+    ctx.replica->primary_seq = j.value("head", cursor);
+    bool any = false;
+    for (const auto &c : j["changes"]) {
+        std::string op = c.value("op", "");
+        bool ok = true;
+        if (op == "del") ok = replica_delete(ctx, { c.value("id", "") }, err);
+        // add/update without a photo: deleted by now, its "del" follows
+        else if (c.contains("photo")) ok = replica_apply_photo(ctx, cli, c["photo"], err);
+        if (!ok) {
+            if (any) replica_save_cursor(ctx, cursor);
+            return false;
+        }
+        cursor = c.value("seq", cursor);
+        any = true;
+    }
+    cursor = std::max(cursor, j.value("seq", cursor));
+    replica_save_cursor(ctx, cursor);
+    return true;
 }
-static json get_blocks(AppContext &ctx, const std::string &scope, const std::string &owner, int start, int count) {
-    sqlite3_stmt *stmt = nullptr;
-    const char *sql_dates = "SELECT DISTINCT date FROM photos WHERE (scope=? OR (scope='personal' AND owner=?)) ORDER BY date DESC LIMIT ? OFFSET ?;";
-    if (sqlite3_prepare_v2(ctx.db, sql_dates, -1, &stmt, NULL) != SQLITE_OK) return {};
-    sqlite3_bind_text(stmt, 1, scope.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, owner.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(stmt, 3, count);
-    sqlite3_bind_int(stmt, 4, start);
-    json out = json::array();
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        const unsigned char *date = sqlite3_column_text(stmt, 0);
-        std::string date_s = std::string((const char*)date);
-        sqlite3_stmt *ps = nullptr;
-        const char *sql_ph = "SELECT id,owner,scope,orig_filename,thumb_path,storage_path,created_at FROM photos WHERE date=? AND (scope=? OR (scope='personal' AND owner=?)) ORDER BY created_at DESC;";
-        if (sqlite3_prepare_v2(ctx.db, sql_ph, -1, &ps, NULL) != SQLITE_OK) continue;
-        sqlite3_bind_text(ps,1,date_s.c_str(),-1,SQLITE_TRANSIENT);
-        sqlite3_bind_text(ps,2,scope.c_str(),-1,SQLITE_TRANSIENT);
-        sqlite3_bind_text(ps,3,owner.c_str(),-1,SQLITE_TRANSIENT);
-        json block;
-        block["date"] = date_s;
-        block["photos"] = json::array();
-        while (sqlite3_step(ps) == SQLITE_ROW) {
-            std::string id = (const char*)sqlite3_column_text(ps,0);
-            std::string owner2 = (const char*)sqlite3_column_text(ps,1);
-            std::string scope2 = (const char*)sqlite3_column_text(ps,2);
-            std::string orig = (const char*)sqlite3_column_text(ps,3);
-            std::string thumb = (const char*)sqlite3_column_text(ps,4);
-            std::string storage = (const char*)sqlite3_column_text(ps,5);
-            std::string created = (const char*)sqlite3_column_text(ps,6);
-            json p;
-            p["id"] = id;
-            p["owner"] = owner2;
-            p["scope"] = scope2;
-            p["thumb_url"] = std::string("/thumbs/") + id;
-            p["full_url"] = std::string("/images/") + id;
-            p["orig_name"] = orig;
-            p["created_at"] = created;
-            block["photos"].push_back(p);
-        }
-        sqlite3_finalize(ps);
-        out.push_back(block);
+// single follower thread: snapshot when there is no cursor yet (or it fell out of the primary's
+// log), then long-polls the change log. Errors back off from 1 to 30 seconds.
+static void replica_worker(AppContext ctx) {
+    ReplicaState &rs = *ctx.replica;
+    long long cursor = -1;
+    sqlite3_exec(ctx.db, "CREATE TABLE IF NOT EXISTS replication_state(key TEXT PRIMARY KEY, value TEXT);", 0, 0, 0);
+    sqlite3_stmt *st = nullptr;
+    if (sqlite3_prepare_v2(ctx.db, "SELECT value FROM replication_state WHERE key='seq';", -1, &st, NULL) == SQLITE_OK &&
+        sqlite3_step(st) == SQLITE_ROW) cursor = std::atoll((const char*)sqlite3_column_text(st, 0));
+    sqlite3_finalize(st);
+    if (cursor >= 0) rs.applied_seq = cursor;
+    Client cli(ctx.cfg.replica_of);
+    cli.set_default_headers({ { "X-Replication-Key", ctx.cfg.replication_key } });
+    cli.set_connection_timeout(5);
+    cli.set_read_timeout(60);   // changes are long-polled for 25s
+    cli.set_keep_alive(true);
+    int backoff = 1, wait = 0;   // the first pull after start or an error does not wait, so status is fresh at once
+    for (;;) {
+        rs.state = cursor < 0 ? 1 : 2;
+        std::string err;
+        bool ok = cursor < 0 ? replica_snapshot(ctx, cli, cursor, err) : replica_pull(ctx, cli, cursor, wait, err);
+        if (ok) {
+            replica_set_error(rs, "");
+            backoff = 1;
+            wait = 25;
+            continue;
+        }
+        rs.state = 3;
+        replica_set_error(rs, err);
+        std::this_thread::sleep_for(std::chrono::seconds(backoff));
+        backoff = std::min(backoff * 2, 30);
+        wait = 0;
     }
-    sqlite3_finalize(stmt);
-    return out;
 }
 
 // helper: try to parse metadata JSON from a file
@@ -454,6 +2923,7 @@ static std::string make_jwt(const AppContext &ctx, const std::string &username,
     return signing_input + "." + sig_hex;
 }
 static bool verify_jwt(const AppContext &ctx, const std::string &token, std::string &username_out) {
+    PhaseTimer timer(kPhaseAuth);
     auto pos = token.rfind('.');
     if (pos == std::string::npos) return false;
     auto signing_input = token.substr(0,pos);
@@ -474,14 +2944,388 @@ static bool verify_jwt(const AppContext &ctx, const std::string &token, std::str
     } catch(...) { return false; }
 }
 
+// --- response compression ---
+// true if Accept-Encoding lists `enc` without q=0
+// true if `token` is listed in an Accept-style header value with a non-zero q
+static bool header_accepts(const std::string &ae, const char *token) {
+    size_t pos = 0;
+    while (pos < ae.size()) {
+        size_t end = ae.find(',', pos);
+        if (end == std::string::npos) end = ae.size();
+        std::string item = ae.substr(pos, end - pos);
+        pos = end + 1;
+        size_t semi = item.find(';');
+        std::string name = item.substr(0, semi);
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        if (name != token) continue;
+        if (semi != std::string::npos) {
+            std::string params = item.substr(semi + 1);
+            auto q = params.find("q=");
+            if (q != std::string::npos && std::atof(params.c_str() + q + 2) <= 0.0) return false;
+        }
+        return true;
+    }
+    return false;
+}
+static bool accepts_encoding(const Request &req, const char *enc) {
+    return header_accepts(req.get_header_value("Accept-Encoding"), enc);
+}
+// thumbnail negotiation: the first configured variant that the Accept header lists and that is
+// already encoded, else the JPEG thumbnail, else the original. Each is looked up in the pack
+// first, then as a loose file. The ETag is per stored variant, so with `Vary: Accept` caches keep
+// one entry per variant. mime is empty for the original (sniffed later).
+struct ThumbChoice {
+    std::string path, mime, etag;   // path: the file, or the pack key when packed
+    bool packed = false;
+    PackLoc loc;
+};
+static bool choose_thumb(const AppContext &ctx, const std::string &id, const std::string &accept, const std::string &thumb_path,
+                         const std::string &storage_path, ThumbChoice &out) {
+    PhaseTimer timer(kPhaseFileIo);
+    auto pick_packed = [&](const char *ext, const char *mime) {
+        PackLoc loc;
+        if (!ctx.thumbs || !ctx.thumbs->find(thumb_key(id, ext), loc)) return false;
+        char tag[64];
+        std::snprintf(tag, sizeof(tag), "\"%s-%08x-%x\"", ext, loc.crc, loc.length);
+        out = ThumbChoice{ thumb_key(id, ext), mime, tag, true, loc };
+        return true;
+    };
+    auto pick = [&](const std::string &path, const char *mime) {
+        struct stat st;
+        if (path.empty() || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+        char tag[96];
+        std::snprintf(tag, sizeof(tag), "\"%s-%llx-%llx\"", file_extension(path).c_str(),
+                      (unsigned long long)st.st_mtime, (unsigned long long)st.st_size);
+        out = ThumbChoice{ path, mime, tag, false, PackLoc() };
+        return true;
+    };
+    for (const auto &name : ctx.cfg.thumb_formats) {
+        const ThumbFormat *f = find_thumb_format(name);
+        if (!f || !header_accepts(accept, f->mime)) continue;
+        if (pick_packed(f->ext, f->mime) || (!thumb_path.empty() && pick(thumb_variant_path(thumb_path, f->ext), f->mime))) return true;
+    }
+    return pick_packed("jpg", "image/jpeg") || pick(thumb_path, "image/jpeg") || pick(storage_path, "");
+}
+static std::string read_thumb(const AppContext &ctx, const ThumbChoice &c) {
+    std::string data;
+    if (c.packed) { if (!ctx.thumbs->read(c.path, c.loc, data)) data.clear(); }
+    else data = read_file_binary(c.path);
+    return data;
+}
+static bool is_compressible_type(const std::string &ct) {
+    return ct.rfind("text/", 0) == 0 || ct.rfind("application/json", 0) == 0 ||
+           ct.rfind("application/javascript", 0) == 0 || ct.rfind("image/svg+xml", 0) == 0;
+}
+// gzip with a per-thread z_stream that is reset rather than re-allocated for every response
+static bool gzip_compress(const std::string &in, std::string &out, int level) {
+    struct GzipState {
+        z_stream zs;
+        int level = -1;
+        ~GzipState() { if (level >= 0) deflateEnd(&zs); }
+    };
+    thread_local GzipState st;
+    if (st.level != level) {
+        if (st.level >= 0) deflateEnd(&st.zs);
+        st.level = -1;
+        std::memset(&st.zs, 0, sizeof(st.zs));
+        if (deflateInit2(&st.zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+        st.level = level;
+    } else if (deflateReset(&st.zs) != Z_OK) {
+        return false;
+    }
+    out.resize(deflateBound(&st.zs, in.size()));
+    st.zs.next_in = (Bytef*)in.data();
+    st.zs.avail_in = (uInt)in.size();
+    st.zs.next_out = (Bytef*)&out[0];
+    st.zs.avail_out = (uInt)out.size();
+    if (deflate(&st.zs, Z_FINISH) != Z_STREAM_END) return false;
+    out.resize(st.zs.total_out);
+    return true;
+}
+static bool brotli_compress(const std::string &in, std::string &out, int quality) {
+#ifdef HAVE_BROTLI
+    size_t n = BrotliEncoderMaxCompressedSize(in.size());
+    if (n == 0) return false;
+    out.resize(n);
+    if (!BrotliEncoderCompress(std::min(quality, BROTLI_MAX_QUALITY), BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               in.size(), (const uint8_t*)in.data(), &n, (uint8_t*)&out[0])) return false;
+    out.resize(n);
+    return true;
+#else
+    return false;
+#endif
+}
+// post-routing: negotiate br/gzip for text and JSON bodies above the size threshold.
+// Streamed (content provider) responses and ones that already carry an encoding are left alone.
+static void compress_response(const Config &cfg, const Request &req, Response &res) {
+    PhaseTimer timer(kPhaseSerialize);
+    if (res.body.size() < (size_t)cfg.compression_min_bytes || res.status == 206) return;
+    if (res.has_header("Content-Encoding")) return;
+    if (!is_compressible_type(res.get_header_value("Content-Type"))) return;
+    std::string out;
+    const char *encoding = nullptr;
+    if (accepts_encoding(req, "br") && brotli_compress(res.body, out, cfg.compression_level)) encoding = "br";
+    else if (accepts_encoding(req, "gzip") && gzip_compress(res.body, out, cfg.compression_level)) encoding = "gzip";
+    if (!encoding || out.size() >= res.body.size()) return;
+    res.body.swap(out);
+    res.headers.erase("Content-Length");
+    res.set_header("Content-Length", std::to_string(res.body.size()));
+    res.set_header("Content-Encoding", encoding);
+    res.set_header("Vary", "Accept-Encoding");
+}
+
+// --- static web assets: compiled into the binary (web_assets.cpp), served from memory with ETags ---
+// embedded assets are views into kWebAssets, the only copy of their bytes; web_dir files own theirs in `data`
+struct StaticAsset {
+    std::string mime, etag;
+    std::string_view body, gzip, br;
+    std::shared_ptr<const std::string> data;
+};
+static std::string sha256_hex(const std::string &data) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_Digest(data.data(), data.size(), md, &len, EVP_sha256(), NULL);
+    std::ostringstream oss;
+    oss << std::hex << std::setfill('0');
+    for (unsigned int i = 0; i < len; ++i) oss << std::setw(2) << (int)md[i];
+    return oss.str();
+}
+static void load_embedded_assets(std::map<std::string, StaticAsset> &out) {
+    for (size_t i = 0; i < kWebAssetCount; ++i) {
+        const EmbeddedAsset &e = kWebAssets[i];
+        StaticAsset a;
+        a.mime = content_type_for(e.path);
+        a.etag = e.etag;
+        a.body = std::string_view((const char*)e.body, e.body_size);
+        if (is_compressible_type(a.mime)) {
+            if (e.gzip) a.gzip = std::string_view((const char*)e.gzip, e.gzip_size);
+            if (e.br) a.br = std::string_view((const char*)e.br, e.br_size);
+        }
+        out[e.path] = std::move(a);
+    }
+}
+// development override: read from web_dir on every request so edits show up without a rebuild.
+// Left uncompressed here; compress_response handles it like any other text body.
+static bool load_static_file(const std::string &root, const std::string &path, StaticAsset &a) {
+    if (path.find("..") != std::string::npos) return false;
+    struct stat st;
+    std::string full = root + path;
+    if (stat(full.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    auto data = std::make_shared<const std::string>(read_file_binary(full));
+    a.body = *data;
+    a.data = data;
+    a.mime = content_type_for(path);
+    a.etag = "\"" + sha256_hex(*data).substr(0, 16) + "\"";
+    return true;
+}
+static void serve_static_asset(const StaticAsset &a, const Request &req, Response &res) {
+    res.set_header("ETag", a.etag);
+    res.set_header("Cache-Control", "no-cache");
+    res.set_header("Vary", "Accept-Encoding");
+    if (req.get_header_value("If-None-Match") == a.etag) { res.status = 304; return; }
+    std::string_view v = a.body;
+    if (!a.br.empty() && accepts_encoding(req, "br")) {
+        res.set_header("Content-Encoding", "br");
+        v = a.br;
+    } else if (!a.gzip.empty() && accepts_encoding(req, "gzip")) {
+        res.set_header("Content-Encoding", "gzip");
+        v = a.gzip;
+    }
+    // web_dir files go through res.body, where compress_response picks them up
+    if (a.data || v.empty()) { res.set_content(v.data(), v.size(), a.mime); return; }
+    // embedded bytes are written to the socket straight from the static array
+    res.set_content_provider(v.size(), a.mime, [v](size_t offset, size_t length, DataSink &sink) {
+        return sink.write(v.data() + offset, length);
+    });
+}
+
+// --- HTTPS: one SSL_CTX per process, so the session cache and ticket keys are shared by all connections ---
+// Session-id cache kept outside OpenSSL as DER. httplib frees connections the client closed without
+// SSL_shutdown, and OpenSSL then drops (and marks unresumable) the session from its internal cache.
+class TlsSessionCache {
+public:
+    explicit TlsSessionCache(size_t max) : max_(max) {}
+    void put(SSL_SESSION *sess) {
+        unsigned int len = 0;
+        const unsigned char *id = SSL_SESSION_get_id(sess, &len);
+        int n = i2d_SSL_SESSION(sess, nullptr);
+        if (len == 0 || n <= 0) return;
+        std::string der((size_t)n, '\0');
+        unsigned char *p = (unsigned char*)&der[0];
+        i2d_SSL_SESSION(sess, &p);
+        time_t expires = (time_t)SSL_SESSION_get_time(sess) + (time_t)SSL_SESSION_get_timeout(sess);
+        std::string key((const char*)id, len);
+        std::lock_guard<std::mutex> lk(m_);
+        auto it = map_.find(key);
+        if (it == map_.end()) order_.push_back(key);
+        map_[key] = { std::move(der), expires };
+        while (map_.size() > max_ && !order_.empty()) { map_.erase(order_.front()); order_.pop_front(); }
+    }
+    SSL_SESSION *get(const unsigned char *id, int len) {
+        std::string der;
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            auto it = map_.find(std::string((const char*)id, (size_t)len));
+            if (it == map_.end() || it->second.second < time(nullptr)) return nullptr;
+            der = it->second.first;
+        }
+        const unsigned char *p = (const unsigned char*)der.data();
+        return d2i_SSL_SESSION(nullptr, &p, (long)der.size());
+    }
+private:
+    std::mutex m_;
+    size_t max_;
+    std::unordered_map<std::string, std::pair<std::string, time_t>> map_; // id -> DER, expiry
+    std::deque<std::string> order_;                                        // oldest first, for eviction
+};
+static bool setup_tls_context(const Config &cfg, SSL_CTX &ssl_ctx) {
+    SSL_CTX *c = &ssl_ctx;
+    SSL_CTX_set_options(c, SSL_OP_NO_COMPRESSION | SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION);
+    SSL_CTX_set_min_proto_version(c, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(c, cfg.tls_cert.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(c, cfg.tls_key.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(c) != 1) {
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+    static const unsigned char sid_ctx[] = "local-photo-server";
+    SSL_CTX_set_session_id_context(c, sid_ctx, sizeof(sid_ctx) - 1);
+    if (cfg.tls_session_cache > 0) {
+        // lives as long as the context, i.e. the process
+        SSL_CTX_set_app_data(c, new TlsSessionCache((size_t)cfg.tls_session_cache));
+        SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(c, [](SSL *ssl, SSL_SESSION *sess) {
+            static_cast<TlsSessionCache*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)))->put(sess);
+            return 0;
+        });
+        SSL_CTX_sess_set_get_cb(c, [](SSL *ssl, const unsigned char *id, int len, int *copy) {
+            *copy = 0;
+            return static_cast<TlsSessionCache*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)))->get(id, len);
+        });
+    } else {
+        SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_OFF);
+    }
+    SSL_CTX_set_timeout(c, cfg.tls_session_timeout);
+    if (!cfg.tls_session_tickets) SSL_CTX_set_options(c, SSL_OP_NO_TICKET);
+#ifdef SSL_OP_ENABLE_KTLS
+    if (cfg.tls_ktls) SSL_CTX_set_options(c, SSL_OP_ENABLE_KTLS);
+#endif
+    return true;
+}
+// kTLS is negotiated per connection after the handshake; report once whether the kernel took it
+static void log_ktls_once(const Request &req) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    static std::atomic<bool> logged{false};
+    if (!req.ssl || logged.exchange(true)) return;
+    bool on = BIO_get_ktls_send(SSL_get_wbio(req.ssl));
+    std::cout << "Kernel TLS " << (on ? "active" : "not available (tls module or cipher), encrypting in OpenSSL")
+              << " for " << SSL_get_version(req.ssl) << " " << SSL_get_cipher_name(req.ssl) << std::endl;
+#endif
+}
+
+static bool is_loopback(const std::string &addr) {
+    return addr == "127.0.0.1" || addr == "::1" || addr == "::ffff:127.0.0.1";
+}
+// debug access: only with debug_endpoints on, and only for a request made on the machine itself
+// (loopback on both ends, Host naming localhost, no forwarding headers). A local reverse proxy
+// connects over loopback too; these checks catch the usual setups, but one that strips
+// X-Forwarded-For and rewrites Host to localhost is indistinguishable, hence the opt-in.
+static bool is_local_request(const Config &cfg, const Request &req) {
+    if (!cfg.debug_endpoints) return false;
+    if (req.has_header("X-Forwarded-For") || req.has_header("Forwarded") || req.has_header("X-Real-IP")) return false;
+    if (!is_loopback(req.remote_addr) || !is_loopback(req.local_addr)) return false;
+    std::string host = req.get_header_value("Host");
+    size_t colon = host.rfind(':');
+    if (colon != std::string::npos && host.find(']', colon) == std::string::npos) host.resize(colon);
+    return host == "localhost" || host == "127.0.0.1" || host == "[::1]";
+}
+
+// on a replica every write (login included: users live on the primary) is replayed on the primary and
+// its answer relayed. Not a redirect: browsers drop Authorization on a cross-origin redirect.
+static void proxy_to_primary(const Config &cfg, const Request &req, Response &res) {
+    static const char *const hop[] = { "Host", "Content-Length", "Connection", "Keep-Alive", "Transfer-Encoding",
+                                       "Accept-Encoding", "REMOTE_ADDR", "REMOTE_PORT", "LOCAL_ADDR", "LOCAL_PORT" };
+    auto skip = [](const std::string &name) {
+        for (const char *h : hop) if (strcasecmp(name.c_str(), h) == 0) return true;
+        return false;
+    };
+    Headers headers;
+    for (const auto &h : req.headers) if (!skip(h.first)) headers.emplace(h.first, h.second);
+    std::string xff = req.get_header_value("X-Forwarded-For");
+    headers.erase("X-Forwarded-For");
+    headers.emplace("X-Forwarded-For", xff.empty() ? req.remote_addr : xff + ", " + req.remote_addr);
+    Client cli(cfg.replica_of);
+    cli.set_path_encode(false);  // req.target is forwarded as received
+    cli.set_connection_timeout(5);
+    cli.set_read_timeout(120);   // uploads are thumbnailed before the primary answers
+    Result r;
+    if (req.method == "POST" && req.is_multipart_form_data()) {
+        // httplib has already split the body into parts; they go out again as a new multipart body
+        UploadFormDataItems items;
+        for (const auto &f : req.form.fields) items.push_back({ f.second.name, f.second.content, "", "" });
+        for (const auto &f : req.form.files) items.push_back({ f.second.name, f.second.content, f.second.filename, f.second.content_type });
+        headers.erase("Content-Type");
+        r = cli.Post(req.target, headers, items);
+    } else {
+        Request out;
+        out.method = req.method;
+        out.path = req.target;
+        out.headers = std::move(headers);
+        out.body = req.body;
+        r = cli.send(out);
+    }
+    if (!r) {
+        res.status = 502;
+        res.set_content("{\"error\":\"primary_unreachable\"}", "application/json");
+        return;
+    }
+    res.status = r->status;
+    for (const auto &h : r->headers) if (!skip(h.first)) res.set_header(h.first, h.second);
+    res.body = std::move(r->body);
+}
+
+// token from Authorization: Bearer, ?t= or a token/auth/t cookie (same order as /thumbs and /images)
+static std::string request_token(const Request &req) {
+    std::string auth = req.get_header_value("Authorization");
+    if (auth.rfind("Bearer ",0) == 0) return auth.substr(7);
+    if (req.has_param("t")) return req.get_param_value("t");
+    std::string cookie = req.get_header_value("Cookie");
+    for (const char *name : {"token", "auth", "t"}) {
+        std::string key = std::string(name) + "=";
+        size_t p = cookie.find(key);
+        if (p == std::string::npos) continue;
+        size_t start = p + key.size();
+        size_t q = cookie.find(";", start);
+        if (q == std::string::npos) q = cookie.size();
+        if (q > start) return cookie.substr(start, q - start);
+    }
+    return {};
+}
+static constexpr size_t kExportMaxIds = 5000; // per /api/export selection (web/app.js EXPORT_MAX_IDS)
+static std::vector<std::string> split_ids(const std::string &s, size_t max_count) {
+    std::vector<std::string> out;
+    size_t pos = 0;
+    while (pos <= s.size() && out.size() < max_count) {
+        size_t q = s.find(',', pos);
+        if (q == std::string::npos) q = s.size();
+        if (q > pos) out.push_back(s.substr(pos, q - pos));
+        pos = q + 1;
+    }
+    return out;
+}
+
 int main(int argc, char **argv) {
     std::string config_path;
+    bool migrate_thumbs = false, compact_thumbs = false;
     for (int i=1;i<argc;i++) {
         std::string a = argv[i];
         if (a == "--config" && i+1<argc) { config_path = argv[++i]; }
+        else if (a == "--migrate-thumbs") migrate_thumbs = true;
+        else if (a == "--compact-thumbs") compact_thumbs = true;
     }
     if (config_path.empty()) {
-        std::cerr << "Usage: " << argv[0] << " --config ./config.json\n";
+        std::cerr << "Usage: " << argv[0] << " --config ./config.json [--migrate-thumbs] [--compact-thumbs]\n";
         return 1;
     }
     std::ifstream ifs(config_path);
@@ -497,6 +3341,43 @@ int main(int argc, char **argv) {
     if (jc.contains("thumbnail_size")) ctx.cfg.thumb_size = jc["thumbnail_size"].get<int>();
     if (jc.contains("allow_anonymous_shared")) ctx.cfg.allow_anonymous_shared = jc["allow_anonymous_shared"].get<bool>();
     if (jc.contains("disable_clamav")) ctx.cfg.disable_clamav = jc["disable_clamav"].get<bool>();
+    if (jc.contains("clamd_socket")) ctx.cfg.clamd_socket = jc["clamd_socket"].get<std::string>();
+    if (jc.contains("scan_workers")) ctx.cfg.scan_workers = std::max(1, jc["scan_workers"].get<int>());
+    if (jc.contains("reclaim_per_second")) ctx.cfg.reclaim_per_second = std::max(1, jc["reclaim_per_second"].get<int>());
+    if (jc.contains("scan_retry_seconds")) ctx.cfg.scan_retry_seconds = std::max(1, jc["scan_retry_seconds"].get<int>());
+    if (jc.contains("scan_max_attempts")) ctx.cfg.scan_max_attempts = std::max(1, jc["scan_max_attempts"].get<int>());
+    if (jc.contains("duplicate_distance")) ctx.cfg.duplicate_distance = std::max(0, std::min(PhashIndex::kMaxDistance, jc["duplicate_distance"].get<int>()));
+    if (jc.contains("change_log_keep")) ctx.cfg.change_log_keep = std::max(1, jc["change_log_keep"].get<int>());
+    if (jc.contains("max_event_streams")) ctx.cfg.max_event_streams = std::max(0, jc["max_event_streams"].get<int>());
+    if (jc.contains("http_threads")) ctx.cfg.http_threads = std::max(1, jc["http_threads"].get<int>());
+    if (jc.contains("compression_level")) ctx.cfg.compression_level = std::max(1, std::min(9, jc["compression_level"].get<int>()));
+    if (jc.contains("compression_min_bytes")) ctx.cfg.compression_min_bytes = jc["compression_min_bytes"].get<int>();
+    if (jc.contains("web_dir")) ctx.cfg.web_dir = jc["web_dir"].get<std::string>();
+    if (jc.contains("tls_cert")) ctx.cfg.tls_cert = jc["tls_cert"].get<std::string>();
+    if (jc.contains("tls_key")) ctx.cfg.tls_key = jc["tls_key"].get<std::string>();
+    if (jc.contains("tls_session_cache")) ctx.cfg.tls_session_cache = std::max(0, jc["tls_session_cache"].get<int>());
+    if (jc.contains("tls_session_timeout")) ctx.cfg.tls_session_timeout = std::max(1, jc["tls_session_timeout"].get<int>());
+    if (jc.contains("tls_session_tickets")) ctx.cfg.tls_session_tickets = jc["tls_session_tickets"].get<bool>();
+    if (jc.contains("tls_ktls")) ctx.cfg.tls_ktls = jc["tls_ktls"].get<bool>();
+    if (jc.contains("keep_alive_timeout")) ctx.cfg.keep_alive_timeout = std::max(1, jc["keep_alive_timeout"].get<int>());
+    if (jc.contains("warmup_dates")) ctx.cfg.warmup_dates = std::max(0, jc["warmup_dates"].get<int>());
+    if (jc.contains("warmup_mb_per_second")) ctx.cfg.warmup_mb_per_second = std::max(1, jc["warmup_mb_per_second"].get<int>());
+    if (jc.contains("trace_slots")) ctx.cfg.trace_slots = std::max(0, jc["trace_slots"].get<int>());
+    if (jc.contains("debug_endpoints")) ctx.cfg.debug_endpoints = jc["debug_endpoints"].get<bool>();
+    if (jc.contains("keep_alive_max_requests")) ctx.cfg.keep_alive_max_requests = std::max(1, jc["keep_alive_max_requests"].get<int>());
+    if (jc.contains("replication_key")) ctx.cfg.replication_key = jc["replication_key"].get<std::string>();
+    if (jc.contains("replica_of")) {
+        ctx.cfg.replica_of = jc["replica_of"].get<std::string>();
+        while (!ctx.cfg.replica_of.empty() && ctx.cfg.replica_of.back() == '/') ctx.cfg.replica_of.pop_back();
+    }
+    if (jc.contains("thumbnail_formats")) {
+        ctx.cfg.thumb_formats.clear();
+        for (const auto &f : jc["thumbnail_formats"]) {
+            std::string name = f.get<std::string>();
+            if (find_thumb_format(name)) ctx.cfg.thumb_formats.push_back(name);
+            else std::cerr << "Ignoring unknown thumbnail format: " << name << std::endl;
+        }
+    }
 
     if (!ctx.cfg.timezone.empty()) {
         setenv("TZ", ctx.cfg.timezone.c_str(), 1);
@@ -509,10 +3390,107 @@ int main(int argc, char **argv) {
     ensure_dir(ctx.cfg.storage_root + "/img");
     ensure_dir(ctx.cfg.storage_root + "/thumbs");
     if (!init_db(ctx)) { std::cerr << "DB init failed\n"; return 1; }
+    ctx.changes = std::make_shared<ChangeFeed>();
+    ctx.phashes = std::make_shared<PhashIndex>();
+    if (ctx.cfg.trace_slots > 0) ctx.traces = std::make_shared<TraceRing>((size_t)ctx.cfg.trace_slots);
+    ctx.thumbs = std::make_shared<ThumbPack>();
+    if (!ctx.thumbs->open(ctx.cfg.storage_root + "/packs")) {
+        std::cerr << "Warning: cannot open thumbnail packs, using loose thumbnail files" << std::endl;
+        ctx.thumbs.reset();
+    }
+    if (migrate_thumbs || compact_thumbs) {
+        if (!ctx.thumbs) return 1;
+        if (migrate_thumbs) {
+            size_t moved = migrate_thumb_files(ctx);
+            std::cout << "Moved " << moved << " thumbnail files into " << ctx.cfg.storage_root << "/packs" << std::endl;
+        }
+        if (compact_thumbs) std::cout << "Reclaimed " << ctx.thumbs->compact(0.0, true) << " bytes" << std::endl;
+        return 0;
+    }
+    if (!ctx.cfg.replica_of.empty()) {
+        if (ctx.cfg.replication_key.empty()) { std::cerr << "replica_of needs replication_key" << std::endl; return 1; }
+        ctx.replica = std::make_shared<ReplicaState>();
+    }
+    // on a replica scan results and thumbnail variants come from the primary
+    if (!ctx.cfg.thumb_formats.empty() && !ctx.replica) ctx.transcode = std::make_shared<WorkQueue>();
+    if (ctx.replica) {
+        // replicated rows keep the primary's scan_status; nothing is scanned or published here
+    } else if (ctx.cfg.disable_clamav) {
+        // scanning switched off: nothing would ever publish photos left pending by an earlier run
+        sqlite3_exec(ctx.db, "UPDATE photos SET scan_status='clean' WHERE scan_status IN ('pending_scan','scan_error');", 0, 0, 0);
+    } else {
+        ensure_dir(ctx.cfg.storage_root + "/quarantine");
+        chmod((ctx.cfg.storage_root + "/quarantine").c_str(), 0700);
+        ctx.scan = std::make_shared<WorkQueue>();
+        // photos clamd kept failing on get another round of attempts per start
+        sqlite3_exec(ctx.db, "UPDATE photos SET scan_status='pending_scan' WHERE scan_status='scan_error';", 0, 0, 0);
+        sqlite3_stmt *st = nullptr;
+        if (sqlite3_prepare_v2(ctx.db, "SELECT id FROM photos WHERE scan_status='pending_scan' ORDER BY created_at;", -1, &st, NULL) == SQLITE_OK) {
+            while (sqlite3_step(st) == SQLITE_ROW) ctx.scan->ids.push_back((const char*)sqlite3_column_text(st, 0));
+        }
+        sqlite3_finalize(st);
+        for (int i = 0; i < ctx.cfg.scan_workers; ++i) std::thread(scan_worker, ctx).detach();
+    }
+    ctx.reclaim = std::make_shared<WorkQueue>();
+    std::thread(reclaim_worker, ctx).detach();
+    if (ctx.transcode) std::thread(transcode_worker, ctx).detach();
+    if (ctx.replica) {
+        std::thread(replica_worker, ctx).detach();
+        std::cout << "Read replica of " << ctx.cfg.replica_of << ", writes are forwarded there" << std::endl;
+    }
+    std::thread(phash_backfill, ctx).detach();
+    if (ctx.cfg.warmup_dates > 0) {
+        ctx.warmup = std::make_shared<Warmup>();
+        std::thread(warmup_worker, ctx).detach();
+    }
+    if (ctx.thumbs) {
+        // deletes only append tombstones; rewrite segments that are mostly dead once an hour
+        std::thread([packs = ctx.thumbs] {
+            for (;;) {
+                std::this_thread::sleep_for(std::chrono::hours(1));
+                if (uint64_t n = packs->compact(0.5)) std::cout << "Thumbnail packs: reclaimed " << n << " bytes" << std::endl;
+            }
+        }).detach();
+    }
 
-    Server svr;
+    std::unique_ptr<Server> server;
+    bool tls = !ctx.cfg.tls_cert.empty() || !ctx.cfg.tls_key.empty();
+    if (tls) {
+        server.reset(new SSLServer([&cfg = ctx.cfg](SSL_CTX &c) { return setup_tls_context(cfg, c); }));
+        if (!server->is_valid()) { std::cerr << "Cannot load tls_cert / tls_key" << std::endl; return 1; }
+    } else {
+        server.reset(new Server());
+    }
+    Server &svr = *server;
     svr.set_payload_max_length(ctx.cfg.max_upload_mb * 1024 * 1024);
-    svr.set_mount_point("/", "./web");
+    svr.set_keep_alive_timeout(ctx.cfg.keep_alive_timeout);
+    svr.set_keep_alive_max_count((size_t)ctx.cfg.keep_alive_max_requests);
+    // headers and body go out as separate writes; without this Nagle holds the body for the client's delayed ACK
+    svr.set_tcp_nodelay(true);
+    // /api/events streams hold their thread; keep headroom for ordinary requests
+    svr.new_task_queue = [n = std::max(ctx.cfg.http_threads, ctx.cfg.max_event_streams + 8)] { return new ThreadPool((size_t)n); };
+    if (ctx.traces) {
+        svr.set_pre_routing_handler([](const Request &req, Response &) {
+            trace_begin(req);
+            return Server::HandlerResponse::Unhandled;
+        });
+    }
+    // runs for every response just before it is written, so traces end here (socket time excluded)
+    svr.set_post_routing_handler([cfg = ctx.cfg, tls, traces = ctx.traces](const Request &req, Response &res) {
+        if (tls) log_ktls_once(req);
+        compress_response(cfg, req, res);
+        if (traces) trace_end(*traces, res);
+    });
+
+    // replica: writes go to the primary. Registered first so they win over the local handlers;
+    // POST /api/export only reads.
+    if (ctx.replica) {
+        auto proxy = [cfg = ctx.cfg](const Request &req, Response &res) { proxy_to_primary(cfg, req, res); };
+        svr.Post(R"((?!/api/export$).*)", proxy);
+        svr.Put(R"(.*)", proxy);
+        svr.Patch(R"(.*)", proxy);
+        svr.Delete(R"(.*)", proxy);
+    }
 
     // login
     svr.Post("/api/login", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
@@ -530,7 +3508,11 @@ int main(int argc, char **argv) {
             std::string pass_hash = (const char*)sqlite3_column_text(stmt,0);
             sqlite3_finalize(stmt);
             // verify password using argon2 (assumes encoded PHC string stored)
-            int rc = argon2_verify(pass_hash.c_str(), password.c_str(), password.size(), Argon2_id);
+            int rc;
+            {
+                PhaseTimer timer(kPhaseAuth);
+                rc = argon2_verify(pass_hash.c_str(), password.c_str(), password.size(), Argon2_id);
+            }
             if (rc != ARGON2_OK) { res.status=401; res.set_content("{\"error\":\"invalid\"}","application/json"); return; }
             std::string token = make_jwt(context, username, 3600);
             json out = { {"token", token}, {"expires_in", 3600} };
@@ -602,10 +3584,18 @@ int main(int argc, char **argv) {
         // generate thumbnail into img folder as well
         std::string thumb_name = id + ".thumb.jpg";
         std::string thumb_fullpath = img_dir + "/" + thumb_name;
+        std::string placeholder;
+        uint64_t phash = 0;
+        bool has_phash = false;
         if (!create_thumbnail(img_fullpath, thumb_fullpath, context.cfg.thumb_size)) {
             std::cerr << "Warning: thumbnail generation failed for " << img_fullpath << std::endl;
         } else {
             chmod(thumb_fullpath.c_str(), 0640);
+            // computed once from the fresh thumbnail, served inline by /api/blocks
+            placeholder = create_placeholder(thumb_fullpath);
+            // hashing the 300px thumbnail is much cheaper than decoding the original again
+            has_phash = compute_dhash(thumb_fullpath, phash);
+            if (context.thumbs) context.thumbs->put_file(thumb_key(id, "jpg"), thumb_fullpath);
         }
 
         // create per-date metadata file in shared or personal/date dir
@@ -625,22 +3615,35 @@ int main(int argc, char **argv) {
         if (!write_text_file(meta_path, meta.dump())) {
             // best-effort: remove img/thumb then fail
             remove_if_exists(img_fullpath);
-            remove_if_exists(thumb_fullpath);
+            remove_thumbs(context, id, thumb_fullpath);
             res.status=500; res.set_content("{\"error\":\"meta_write_failed\"}", "application/json");
             return;
         }
         chmod(meta_path.c_str(), 0640);
 
         // store record in DB (storage_path and thumb_path point to real files)
-        if (!insert_photo_record(context, id, authed?username:"", scope, date, orig_name, img_fullpath, thumb_fullpath, meta_path)) {
+        // not served until clamd has seen it (scan_worker); no added upload latency
+        const char *scan_status = context.scan ? "pending_scan" : "clean";
+        if (!insert_photo_record(context, id, authed?username:"", scope, date, orig_name, img_fullpath, thumb_fullpath, meta_path, placeholder, scan_status, has_phash ? &phash : nullptr)) {
             remove_if_exists(img_fullpath);
-            remove_if_exists(thumb_fullpath);
+            remove_thumbs(context, id, thumb_fullpath);
             remove_if_exists(meta_path);
             res.status=500; res.set_content("{\"error\":\"db\"}", "application/json");
             return;
         }
+        // webp/avif variants are encoded in the background; /thumbs serves the JPEG until then
+        if (context.scan) queue_push(*context.scan, id);
+        else enqueue_transcode(context, id);
 
-        json out = { {"status","ok"}, {"id", id}, {"thumb_url", std::string("/thumbs/") + id}, {"full_url", std::string("/images/") + id} };
+        json out = { {"status","ok"}, {"id", id}, {"thumb_url", std::string("/thumbs/") + id}, {"full_url", std::string("/images/") + id}, {"scan_status", scan_status} };
+        // ?check_duplicates=1: ids of near-identical photos already visible alongside this one
+        if (has_phash) {
+            std::string owner = authed ? username : "";
+            if (req.get_param_value("check_duplicates") == "1")
+                out["duplicates"] = context.phashes->near(phash, scope, owner, context.cfg.duplicate_distance, id);
+            // pending photos join the index with its next rebuild, once they are clean
+            if (!context.scan) context.phashes->add(id, phash, scope, owner);
+        }
         res.set_content(out.dump(), "application/json");
     });
 
@@ -650,6 +3653,7 @@ int main(int argc, char **argv) {
         std::string scope = req.get_param_value("scope") != "" ? req.get_param_value("scope") : "shared";
         int start = 0; if (req.has_param("start")) start = std::stoi(req.get_param_value("start"));
         int count = 5; if (req.has_param("count")) count = std::stoi(req.get_param_value("count"));
+        std::string until = date_upper_bound(req);
         std::string auth = req.get_header_value("Authorization");
         std::string username;
         std::string token;
@@ -664,55 +3668,157 @@ int main(int argc, char **argv) {
             token = make_jwt(context, username);
         }
 
+        std::string &buf = json_buffer();
+        JsonWriter w(buf);
         if (scope == "personal") {
             if (username.empty()) { res.status=401; res.set_content("{\"error\":\"auth_required\"}","application/json"); return; }
             // Build blocks only for this owner to ensure other users cannot see personal photos
-            json out = json::array();
-            sqlite3_stmt *stmt = nullptr;
-            const char *sql_dates = "SELECT DISTINCT date FROM photos WHERE scope='personal' AND owner=? ORDER BY date DESC LIMIT ? OFFSET ?;";
-            if (sqlite3_prepare_v2(context.db, sql_dates, -1, &stmt, NULL) == SQLITE_OK) {
-                sqlite3_bind_text(stmt,1, username.c_str(), -1, SQLITE_TRANSIENT);
-                sqlite3_bind_int(stmt,2, count);
-                sqlite3_bind_int(stmt,3, start);
-                while (sqlite3_step(stmt) == SQLITE_ROW) {
-                    const unsigned char *date = sqlite3_column_text(stmt,0);
-                    std::string date_s = std::string((const char*)date);
-                    sqlite3_stmt *ps = nullptr;
-                    const char *sql_ph = "SELECT id,owner,scope,orig_filename,thumb_path,storage_path,created_at FROM photos WHERE date=? AND scope='personal' AND owner=? ORDER BY created_at DESC;";
-                    if (sqlite3_prepare_v2(context.db, sql_ph, -1, &ps, NULL) == SQLITE_OK) {
-                        sqlite3_bind_text(ps,1,date_s.c_str(), -1, SQLITE_TRANSIENT);
-                        sqlite3_bind_text(ps,2,username.c_str(), -1, SQLITE_TRANSIENT);
-                        json block;
-                        block["date"] = date_s;
-                        block["photos"] = json::array();
-                        while (sqlite3_step(ps) == SQLITE_ROW) {
-                            json p;
-                            p["id"] = std::string((const char*)sqlite3_column_text(ps,0));
-                            p["owner"] = std::string((const char*)sqlite3_column_text(ps,1));
-                            p["scope"] = std::string((const char*)sqlite3_column_text(ps,2));
-                            p["orig_name"] = std::string((const char*)sqlite3_column_text(ps,3));
-                            std::string id = std::string((const char*)sqlite3_column_text(ps,0));
-                            p["thumb_url"] = std::string("/thumbs/") + id;
-                            p["full_url"] = std::string("/images/") + id;
-                            if (!token.empty()) {
-                                p["thumb_url"] = p["thumb_url"].get<std::string>() + std::string("?t=") + token;
-                                p["full_url"] = p["full_url"].get<std::string>() + std::string("?t=") + token;
-                            }
-                            p["created_at"] = std::string((const char*)sqlite3_column_text(ps,6));
-                            block["photos"].push_back(p);
-                        }
-                        sqlite3_finalize(ps);
-                        out.push_back(block);
-                    }
-                }
-                sqlite3_finalize(stmt);
-            }
-            res.set_content(out.dump(), "application/json");
+            write_blocks(context, w, "", username, until, start, count, token);
+        } else {
+            write_blocks(context, w, scope, "", until, start, count, "");
+        }
+        res.set_content(buf.data(), buf.size(), "application/json");
+    });
+
+    // delta sync: ?scope=&since=<seq>[&limit=] -> changes after since (see write_changes). Without
+    // since only {"seq":N} is returned: take it before loading /api/blocks, then sync from there.
+    // 410 when since is older than the retained log (the client reloads instead).
+    svr.Get(R"(/api/changes)", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
+        auto &context = *ctxPtr;
+        std::string scope = req.get_param_value("scope") != "" ? req.get_param_value("scope") : "shared";
+        if (scope != "personal" && scope != "shared") { res.status=400; res.set_content("{\"error\":\"bad_scope\"}","application/json"); return; }
+        std::string token = request_token(req);
+        std::string username;
+        if (!token.empty() && !verify_jwt(context, token, username)) token.clear();
+        if (scope == "personal" && username.empty()) { res.status=401; res.set_content("{\"error\":\"auth_required\"}","application/json"); return; }
+        long long lo = 0, hi = 0;
+        change_log_bounds(context.db, lo, hi);
+        if (!req.has_param("since")) {
+            res.set_content("{\"seq\":" + std::to_string(hi) + "}", "application/json");
+            return;
+        }
+        long long since = 0;
+        int limit = 500;
+        try {
+            since = std::stoll(req.get_param_value("since"));
+            if (req.has_param("limit")) limit = std::max(1, std::min(1000, std::stoi(req.get_param_value("limit"))));
+        } catch(...) { res.status=400; res.set_content("{\"error\":\"bad_request\"}","application/json"); return; }
+        if (since > hi || (since < hi && since + 1 < lo)) {
+            res.status = 410;
+            res.set_content("{\"error\":\"gone\",\"seq\":" + std::to_string(hi) + "}", "application/json");
+            return;
+        }
+        std::string &buf = json_buffer();
+        JsonWriter w(buf);
+        if (scope == "personal") write_changes(context, w, "", username, since, hi, limit, token);
+        else write_changes(context, w, "shared", "", since, hi, limit, "");
+        res.set_content(buf.data(), buf.size(), "application/json");
+    });
+
+    // push channel for the change log: text/event-stream with `id: <seq>` / `data: {"seq":<seq>}` once a
+    // change visible to the caller is logged; clients then pull /api/changes. Resumes from Last-Event-ID
+    // (or ?since=). Idle streams sleep on the ChangeFeed and only send a comment every 25s.
+    svr.Get(R"(/api/events)", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
+        auto &context = *ctxPtr;
+        std::string scope = req.get_param_value("scope") != "" ? req.get_param_value("scope") : "shared";
+        if (scope != "personal" && scope != "shared") { res.status=400; res.set_content("{\"error\":\"bad_scope\"}","application/json"); return; }
+        std::string username;
+        std::string token = request_token(req);
+        if (!token.empty()) verify_jwt(context, token, username);
+        if (scope == "personal" && username.empty()) { res.status=401; res.set_content("{\"error\":\"auth_required\"}","application/json"); return; }
+        long long since = -1;
+        try {
+            std::string last_id = req.get_header_value("Last-Event-ID");
+            if (!last_id.empty()) since = std::stoll(last_id);
+            else if (req.has_param("since")) since = std::stoll(req.get_param_value("since"));
+        } catch(...) { res.status=400; res.set_content("{\"error\":\"bad_request\"}","application/json"); return; }
+        if (since < 0) {
+            long long lo = 0;
+            change_log_bounds(context.db, lo, since);
+        }
+        // every open stream pins one server thread
+        auto feed = context.changes;
+        if (feed->streams.fetch_add(1) >= context.cfg.max_event_streams) {
+            feed->streams.fetch_sub(1);
+            res.status = 503;
+            res.set_header("Retry-After", "30");
+            res.set_content("{\"error\":\"too_many_streams\"}", "application/json");
             return;
         }
-        
-        json blocks = get_blocks(context, scope, std::string(""), start, count);
-        res.set_content(blocks.dump(), "application/json");
+        res.set_header("Cache-Control", "no-store");
+        res.set_header("X-Accel-Buffering", "no");
+        std::string vscope = scope == "personal" ? "" : "shared";
+        std::string owner = scope == "personal" ? username : "";
+        res.set_chunked_content_provider("text/event-stream",
+            [ctxPtr, feed, vscope, owner, last = since](size_t, DataSink &sink) mutable {
+                uint64_t version;
+                {
+                    std::lock_guard<std::mutex> lk(feed->m);
+                    version = feed->version;
+                }
+                // checked before sleeping, so a change logged between two calls is never missed
+                long long seq = last_visible_change(ctxPtr->db, last, vscope, owner);
+                if (seq > 0) {
+                    last = seq;
+                    std::string ev = "id: " + std::to_string(seq) + "\ndata: {\"seq\":" + std::to_string(seq) + "}\n\n";
+                    return sink.write(ev.data(), ev.size());
+                }
+                bool changed;
+                {
+                    std::unique_lock<std::mutex> lk(feed->m);
+                    changed = feed->cv.wait_for(lk, std::chrono::seconds(25), [&] { return feed->version != version; });
+                }
+                if (changed) return true;
+                static const char ping[] = ": ping\n\n";
+                return sink.write(ping, sizeof(ping) - 1);
+            },
+            [feed](bool) { feed->streams.fetch_sub(1); });
+    });
+
+    // timeline: photo counts per year/month/day for the scrubber (no photos scan)
+    svr.Get(R"(/api/timeline)", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
+        auto &context = *ctxPtr;
+        std::string scope = req.get_param_value("scope") != "" ? req.get_param_value("scope") : "shared";
+        if (scope != "personal" && scope != "shared") { res.status=400; res.set_content("{\"error\":\"bad_scope\"}","application/json"); return; }
+        std::string auth = req.get_header_value("Authorization");
+        std::string username;
+        if (auth.rfind("Bearer ",0) == 0) verify_jwt(context, auth.substr(7), username);
+        else if (req.has_param("t")) verify_jwt(context, req.get_param_value("t"), username);
+        if (scope == "personal" && username.empty()) { res.status=401; res.set_content("{\"error\":\"auth_required\"}","application/json"); return; }
+        // same visibility as /api/blocks: personal -> only the caller's photos, shared -> shared only
+        json out = scope == "personal" ? get_timeline(context, "", username) : get_timeline(context, "shared", "");
+        res.set_content(out.dump(), "application/json");
+    });
+
+    // search by original filename / owner (FTS5, prefix match), keyset-paginated via ?before=<next>
+    svr.Get(R"(/api/search)", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
+        auto &context = *ctxPtr;
+        std::string scope = req.get_param_value("scope") != "" ? req.get_param_value("scope") : "shared";
+        if (scope != "personal" && scope != "shared") { res.status=400; res.set_content("{\"error\":\"bad_scope\"}","application/json"); return; }
+        std::string fts_query = build_fts_query(req.get_param_value("q"));
+        if (fts_query.empty()) { res.status=400; res.set_content("{\"error\":\"empty_query\"}","application/json"); return; }
+        long long before = std::numeric_limits<long long>::max();
+        int limit = 50;
+        try {
+            if (req.has_param("before")) before = std::stoll(req.get_param_value("before"));
+            if (req.has_param("limit")) limit = std::stoi(req.get_param_value("limit"));
+        } catch(...) { res.status=400; res.set_content("{\"error\":\"bad_request\"}","application/json"); return; }
+        limit = std::max(1, std::min(limit, 200));
+        std::string auth = req.get_header_value("Authorization");
+        std::string username;
+        std::string token;
+        if (auth.rfind("Bearer ",0) == 0) {
+            token = auth.substr(7);
+            verify_jwt(context, token, username);
+        } else if (req.has_param("t")) {
+            token = req.get_param_value("t");
+            verify_jwt(context, token, username);
+        }
+        if (scope == "personal" && username.empty()) { res.status=401; res.set_content("{\"error\":\"auth_required\"}","application/json"); return; }
+        std::string &buf = json_buffer();
+        JsonWriter w(buf);
+        write_search(context, w, scope, username, fts_query, before, limit, token);
+        res.set_content(buf.data(), buf.size(), "application/json");
     });
 
 
@@ -738,43 +3844,48 @@ int main(int argc, char **argv) {
             }
         }
 
-        json out;
-        out["id"] = id;
-        out["full_url"] = std::string("/images/") + id;
-        out["thumb_url"] = std::string("/thumbs/") + id;
-        out["owner"] = owner;
-        out["scope"] = scope;
+        std::string &buf = json_buffer();
+        JsonWriter w(buf);
+        w.begin_object();
+        w.key("id").value(id);
+        w.key("full_url").value_concat({ "/images/", id.c_str() });
+        w.key("thumb_url").value_concat({ "/thumbs/", id.c_str() });
+        w.key("owner").value(owner);
+        w.key("scope").value(scope);
 
         // try to enrich response from meta file (preferred)
+        bool has_time = false;
         if (!meta_path.empty() && access(meta_path.c_str(), R_OK) == 0) {
             json m;
             if (read_json_file(meta_path, m)) {
-                if (m.contains("time")) out["time"] = m["time"];
-                if (m.contains("orig_name")) out["orig_name"] = m["orig_name"];
+                if (m.contains("time")) { w.key("time").raw(m["time"].dump()); has_time = true; }
+                if (m.contains("orig_name")) w.key("orig_name").raw(m["orig_name"].dump());
             }
         }
 
         // if metadata file did not contain time, try to derive it from file mtime (minute precision)
-        if (!out.contains("time") && !storage_path.empty()) {
+        if (!has_time && !storage_path.empty()) {
             struct stat st;
             if (stat(storage_path.c_str(), &st) == 0) {
                 std::time_t mt = st.st_mtime;
                 std::tm tm;
                 localtime_r(&mt, &tm);
-                char buf[32];
-                std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M", &tm);
-                out["time"] = std::string(buf);
+                char tbuf[32];
+                std::strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M", &tm);
+                w.key("time").value(tbuf);
             }
         }
+        w.end_object();
 
-        res.set_content(out.dump(), "application/json");
+        res.set_content(buf.data(), buf.size(), "application/json");
     });
     // thumbs
     svr.Get(R"(/thumbs/(.*))", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
         auto &context = *ctxPtr;
         std::string id = req.matches[1].str();
-        std::string owner, scope, storage_path, thumb_path, meta_path;
-        if (!lookup_photo(context, id, owner, scope, storage_path, thumb_path, meta_path)) { res.status=404; return; }
+        std::string owner, scope, storage_path, thumb_path, meta_path, scan_status;
+        if (!lookup_photo(context, id, owner, scope, storage_path, thumb_path, meta_path, &scan_status)) { res.status=404; return; }
+        if (context.warmup) context.warmup->note_thumb(id);
         // If thumbnail/image belongs to a personal photo, require auth and owner match.
                 if (scope == "personal") {
             std::string token;
@@ -807,28 +3918,72 @@ int main(int argc, char **argv) {
             }
         }
 
-std::string data;
-        std::string source_path;
-        if (!thumb_path.empty() && access(thumb_path.c_str(), R_OK) == 0) {
-            data = read_file_binary(thumb_path);
-            source_path = thumb_path;
-        } else if (access(storage_path.c_str(), R_OK) == 0) {
-            data = read_file_binary(storage_path);
-            source_path = storage_path;
-        } else {
-            res.status = 404; return;
-        }
+        if (reject_unscanned(scan_status, res)) return;
+        ThumbChoice thumb;
+        if (!choose_thumb(context, id, req.get_header_value("Accept"), thumb_path, storage_path, thumb)) { res.status = 404; return; }
+        res.set_header("Vary", "Accept");
+        res.set_header("ETag", thumb.etag);
+        res.set_header("Cache-Control", scope == "personal" ? "private, no-cache" : "no-cache");
+        if (req.get_header_value("If-None-Match") == thumb.etag) { res.status = 304; return; }
+        std::string data = read_thumb(context, thumb);
         if (data.empty()) { res.status = 500; return; }
-        std::string mime = guess_mime_from_path(source_path);
+        std::string mime = thumb.mime.empty() ? image_content_type(thumb.path, data) : thumb.mime;
         res.set_content(data, mime.c_str());
     });
 
+    // batched thumbnails: GET /api/thumbs?ids=a,b,c -> application/x-thumb-pack
+    // one JWT check and one `IN (...)` query for the whole batch, then for each requested id, in order
+    // (each entry is negotiated against the Accept header like /thumbs, so its mime may differ):
+    //   u16 id_len | id | u16 mime_len | mime | u32 data_len | data   (big-endian; data_len 0 = missing/forbidden)
+    svr.Get(R"(/api/thumbs)", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
+        auto &context = *ctxPtr;
+        auto ids = split_ids(req.get_param_value("ids"), 200);
+        if (ids.empty()) { res.status=400; res.set_content("{\"error\":\"no_ids\"}","application/json"); return; }
+        std::string token = request_token(req);
+        std::string username;
+        if (!token.empty()) verify_jwt(context, token, username);
+
+        std::map<std::string, PhotoRef> found;
+        for (auto &p : lookup_photos(context, ids)) found[p.id] = std::move(p);
+        std::string accept = req.get_header_value("Accept");
+        struct Entry { std::string id; ThumbChoice thumb; };
+        auto entries = std::make_shared<std::vector<Entry>>();
+        for (const auto &id : ids) {
+            Entry e{ id, {} };
+            auto it = found.find(id);
+            // the grid loads through here, so warm-hit stats count each entry like a /thumbs request
+            if (it != found.end() && context.warmup) context.warmup->note_thumb(id);
+            // unscanned/quarantined photos come back empty; the client falls back to /thumbs (202/423)
+            if (it != found.end() && it->second.scan_status == "clean" &&
+                (it->second.scope != "personal" || (!username.empty() && username == it->second.owner))) {
+                choose_thumb(context, id, accept, it->second.thumb_path, it->second.storage_path, e.thumb);
+            }
+            entries->push_back(std::move(e));
+        }
+        res.set_header("Vary", "Accept");
+        res.set_header("Cache-Control", "private, no-store");
+        // one entry per provider call: memory stays at one thumbnail regardless of batch size
+        res.set_chunked_content_provider("application/x-thumb-pack", [ctxPtr, entries, next = size_t(0)](size_t, DataSink &sink) mutable {
+            if (next >= entries->size()) { sink.done(); return true; }
+            const Entry &e = (*entries)[next++];
+            std::string data = e.thumb.etag.empty() ? std::string() : read_thumb(*ctxPtr, e.thumb);
+            std::string mime = data.empty() ? std::string() : !e.thumb.mime.empty() ? e.thumb.mime : image_content_type(e.thumb.path, data);
+            std::string hdr;
+            put_be(hdr, e.id.size(), 2); hdr += e.id;
+            put_be(hdr, mime.size(), 2); hdr += mime;
+            put_be(hdr, data.size(), 4);
+            if (!sink.write(hdr.data(), hdr.size())) return false;
+            if (!data.empty() && !sink.write(data.data(), data.size())) return false;
+            return true;
+        });
+    });
+
     // images
     svr.Get(R"(/images/(.*))", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
         auto &context = *ctxPtr;
         std::string id = req.matches[1].str();
-        std::string owner, scope, storage_path, thumb_path, meta_path;
-        if (!lookup_photo(context, id, owner, scope, storage_path, thumb_path, meta_path)) { res.status=404; return; }
+        std::string owner, scope, storage_path, thumb_path, meta_path, scan_status;
+        if (!lookup_photo(context, id, owner, scope, storage_path, thumb_path, meta_path, &scan_status)) { res.status=404; return; }
                 if (scope == "personal") {
             std::string token;
             std::string auth = req.get_header_value("Authorization");
@@ -860,6 +4015,7 @@ std::string data;
             }
         }
 
+        if (reject_unscanned(scan_status, res)) return;
         std::string data;
         if (access(storage_path.c_str(), R_OK) == 0) {
             data = read_file_binary(storage_path);
@@ -869,13 +4025,104 @@ std::string data;
             res.status = 404; return;
         }
         if (data.empty()) { res.status=500; return; }
-        std::string mime = guess_mime_from_path(storage_path);
+        std::string mime = image_content_type(storage_path, data);
         res.set_header("Access-Control-Allow-Origin", "*");
         res.set_header("Content-Security-Policy", "default-src 'self'; img-src 'self' data: blob:;");
         res.set_content(data, mime.c_str());
     });
 
 
+    // near-duplicate clusters (burst shots, re-saved copies): ?scope=&distance=<bits>&offset=&limit=
+    // -> {"distance":d,"total":n,"clusters":[{"photos":[<blocks entry>...]}]}, largest cluster first
+    svr.Get(R"(/api/duplicates)", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
+        auto &context = *ctxPtr;
+        std::string scope = req.get_param_value("scope") != "" ? req.get_param_value("scope") : "shared";
+        if (scope != "personal" && scope != "shared") { res.status=400; res.set_content("{\"error\":\"bad_scope\"}","application/json"); return; }
+        std::string token = request_token(req);
+        std::string username;
+        if (!token.empty() && !verify_jwt(context, token, username)) token.clear();
+        if (scope == "personal" && username.empty()) { res.status=401; res.set_content("{\"error\":\"auth_required\"}","application/json"); return; }
+        int d = context.cfg.duplicate_distance, offset = 0, limit = 100;
+        try {
+            if (req.has_param("distance")) d = std::stoi(req.get_param_value("distance"));
+            if (req.has_param("offset")) offset = std::max(0, std::stoi(req.get_param_value("offset")));
+            if (req.has_param("limit")) limit = std::max(1, std::min(1000, std::stoi(req.get_param_value("limit"))));
+        } catch(...) { res.status=400; res.set_content("{\"error\":\"bad_request\"}","application/json"); return; }
+        d = std::max(0, std::min(PhashIndex::kMaxDistance, d));
+        context.phashes->refresh(context.db);
+        auto clusters = context.phashes->clusters(scope, scope == "personal" ? username : "", d);
+
+        std::string &buf = json_buffer();
+        JsonWriter w(buf);
+        w.begin_object();
+        w.key("distance").value((long long)d);
+        w.key("total").value((long long)clusters.size());
+        w.key("clusters").begin_array();
+        bool ok = true;
+        for (size_t c = offset; ok && c < clusters.size() && c < (size_t)offset + limit; ++c) {
+            std::vector<std::string> &members = clusters[c];
+            // large clusters (screenshots, near-black frames) take several statements: put the ids in
+            // created_at order first, so each statement's ORDER BY covers a consecutive run
+            if (members.size() > kIdsPerStatement) {
+                std::vector<std::pair<std::string, std::string>> keyed;
+                for (size_t from = 0; ok && from < members.size(); from += kIdsPerStatement) {
+                    sqlite3_stmt *st = prepare_id_list(context.db, "SELECT created_at,id FROM photos WHERE id IN ", ";", members, from,
+                                                       std::min(kIdsPerStatement, members.size() - from));
+                    if (!st) { ok = false; break; }
+                    while (sqlite3_step(st) == SQLITE_ROW)
+                        keyed.emplace_back((const char*)sqlite3_column_text(st, 0), (const char*)sqlite3_column_text(st, 1));
+                    sqlite3_finalize(st);
+                }
+                std::sort(keyed.begin(), keyed.end());
+                members.clear();
+                for (auto &k : keyed) members.push_back(std::move(k.second));
+            }
+            w.begin_object();
+            w.key("photos").begin_array();
+            for (size_t from = 0; ok && from < members.size(); from += kIdsPerStatement) {
+                sqlite3_stmt *st = prepare_id_list(context.db, "SELECT id,owner,scope,orig_filename,created_at,placeholder,scan_status,date FROM photos WHERE id IN ",
+                                                   " ORDER BY created_at, id;", members, from, std::min(kIdsPerStatement, members.size() - from));
+                if (!st) { ok = false; break; }
+                while (sqlite3_step(st) == SQLITE_ROW) write_photo_entry(w, st, 0, 7, scope == "personal" ? token : "");
+                sqlite3_finalize(st);
+            }
+            w.end_array();
+            w.end_object();
+        }
+        w.end_array();
+        w.end_object();
+        // never a page with clusters silently missing
+        if (!ok) { res.status=500; res.set_content("{\"error\":\"db\"}","application/json"); return; }
+        res.set_content(buf.data(), buf.size(), "application/json");
+    });
+
+    // ZIP download of one day (?date=YYYY-MM-DD[&scope=personal]) or of a selection (?ids=a,b,... or the same
+    // fields as a POSTed form, for long selections). Stored, not deflated (JPEGs do not compress), and streamed
+    // file by file through ZipStream, so memory use does not depend on the archive size. Photos the caller
+    // could not open via /images, and unscanned or quarantined ones, are left out.
+    auto export_handler = [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
+        auto &context = *ctxPtr;
+        std::string scope = req.get_param_value("scope") != "" ? req.get_param_value("scope") : "shared";
+        if (scope != "personal" && scope != "shared") { res.status=400; res.set_content("{\"error\":\"bad_scope\"}","application/json"); return; }
+        std::string username;
+        std::string token = request_token(req);
+        if (!token.empty()) verify_jwt(context, token, username);
+        if (scope == "personal" && username.empty()) { res.status=401; res.set_content("{\"error\":\"auth_required\"}","application/json"); return; }
+        std::string date = req.get_param_value("date");
+        std::vector<std::string> ids = split_ids(req.get_param_value("ids"), kExportMaxIds + 1);
+        if (ids.size() > kExportMaxIds) { res.status=413; res.set_content("{\"error\":\"too_many_ids\"}","application/json"); return; }
+        if (date.empty() == ids.empty()) { res.status=400; res.set_content("{\"error\":\"date_or_ids_required\"}","application/json"); return; }
+        auto entries = collect_export(context, date, ids, scope, username);
+        if (entries.empty()) { res.status=404; res.set_content("{\"error\":\"not_found\"}","application/json"); return; }
+        std::string filename = "photos-" + (date.empty() ? std::to_string(entries.size()) : sanitize_filename(date)) + ".zip";
+        res.set_header("Content-Disposition", "attachment; filename=\"" + filename + "\"");
+        res.set_header("Cache-Control", "no-store");
+        auto zip = std::make_shared<ZipStream>(std::move(entries));
+        res.set_chunked_content_provider("application/zip", [zip](size_t, DataSink &sink) { return zip->next(sink); });
+    };
+    svr.Get(R"(/api/export)", export_handler);
+    svr.Post(R"(/api/export)", export_handler);
+
     // DELETE photo: open meta file (if present), delete referenced img and thumb, delete meta file, then delete DB record
     svr.Delete(R"(/api/photo/(.*))", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
         auto &context = *ctxPtr;
@@ -934,6 +4181,8 @@ std::string data;
             remove_if_exists(thumb_path);
         }
 
+        remove_thumbs(context, id, thumb_path);
+
         if (!delete_photo_record(context, id)) {
             res.status = 500;
             res.set_content("{\"error\":\"db_delete_failed\"}", "application/json");
@@ -943,7 +4192,358 @@ std::string data;
         res.set_content("{\"status\":\"ok\"}", "application/json");
     });
 
-    std::cout << "Server started on port " << ctx.cfg.port << "..." << std::endl;
+    // bulk delete: POST /api/photos/delete {"ids":[...]} -> {"deleted":[...],"failed":[{"id","error"}]}
+    // one lookup per 500 ids, one transaction for all rows; files are unlinked in the background
+    svr.Post("/api/photos/delete", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
+        auto &context = *ctxPtr;
+        std::string auth = req.get_header_value("Authorization");
+        std::string username;
+        if (auth.rfind("Bearer ",0) != 0 || !verify_jwt(context, auth.substr(7), username)) {
+            res.status = 401;
+            res.set_content("{\"error\":\"auth_required\"}", "application/json");
+            return;
+        }
+        std::vector<std::string> ids;
+        try {
+            auto j = json::parse(req.body);
+            for (const auto &v : j.at("ids")) ids.push_back(v.get<std::string>());
+        } catch(...) { res.status = 400; res.set_content("{\"error\":\"bad_request\"}","application/json"); return; }
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        if (ids.size() > 5000) { res.status = 400; res.set_content("{\"error\":\"too_many_ids\"}","application/json"); return; }
+
+        std::map<std::string, PhotoRef> found;
+        for (size_t i = 0; i < ids.size(); i += 500) {
+            std::vector<std::string> chunk(ids.begin() + i, ids.begin() + std::min(ids.size(), i + 500));
+            for (auto &p : lookup_photos(context, chunk)) found[p.id] = std::move(p);
+        }
+        // same rules as DELETE /api/photo/<id>: only the owner, never anonymous uploads
+        std::vector<PhotoRef> victims;
+        std::vector<std::pair<std::string, const char*>> failed;
+        for (const auto &id : ids) {
+            auto it = found.find(id);
+            if (it == found.end()) failed.push_back({ id, "not_found" });
+            else if (it->second.owner.empty()) failed.push_back({ id, "forbidden_anonymous" });
+            else if (it->second.owner != username) failed.push_back({ id, "forbidden" });
+            else victims.push_back(it->second);
+        }
+        if (!victims.empty() && !delete_photos(context, victims)) {
+            res.status = 500;
+            res.set_content("{\"error\":\"db_delete_failed\"}", "application/json");
+            return;
+        }
+
+        std::string &buf = json_buffer();
+        JsonWriter w(buf);
+        w.begin_object();
+        w.key("deleted").begin_array();
+        for (const auto &p : victims) w.value(p.id);
+        w.end_array();
+        w.key("failed").begin_array();
+        for (const auto &f : failed) w.begin_object().key("id").value(f.first).key("error").value(f.second).end_object();
+        w.end_array();
+        w.end_object();
+        res.set_content(buf.data(), buf.size(), "application/json");
+    });
+
+    // --- replication (see replica_worker); everything but status needs X-Replication-Key ---
+    // change log for followers, unfiltered: ?since=<seq>[&limit=][&wait=<s>] -> {"changes":[{"seq","op","id",
+    // "photo"}],"seq":<next cursor>,"head":<newest seq>,"more":bool}. With nothing after since the request
+    // waits up to `wait` seconds for a change. 410 like /api/changes when since is out of the log.
+    svr.Get("/api/replication/changes", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
+        auto &context = *ctxPtr;
+        if (!replication_authorized(context.cfg, req, res)) return;
+        long long since = 0;
+        int limit = 200, wait = 0;
+        try {
+            since = std::stoll(req.get_param_value("since"));
+            if (req.has_param("limit")) limit = std::max(1, std::min(1000, std::stoi(req.get_param_value("limit"))));
+            if (req.has_param("wait")) wait = std::max(0, std::min(60, std::stoi(req.get_param_value("wait"))));
+        } catch(...) { res.status=400; res.set_content("{\"error\":\"bad_request\"}","application/json"); return; }
+        auto feed = context.changes;
+        uint64_t version;
+        {
+            std::lock_guard<std::mutex> lk(feed->m);
+            version = feed->version;
+        }
+        long long lo = 0, hi = 0;
+        change_log_bounds(context.db, lo, hi);
+        if (since == hi && wait > 0) {
+            std::unique_lock<std::mutex> lk(feed->m);
+            bool changed = feed->cv.wait_for(lk, std::chrono::seconds(wait), [&] { return feed->version != version; });
+            lk.unlock();
+            if (changed) change_log_bounds(context.db, lo, hi);
+        }
+        if (since > hi || (since < hi && since + 1 < lo)) {
+            res.status = 410;
+            res.set_content("{\"error\":\"gone\",\"seq\":" + std::to_string(hi) + "}", "application/json");
+            return;
+        }
+        std::string sql = std::string("SELECT c.seq,c.op,c.photo_id,") + kReplicaColumns +
+                          " FROM changes c LEFT JOIN photos p ON p.id=c.photo_id AND c.op<>'del'"
+                          " WHERE c.seq > ? AND c.seq <= ? ORDER BY c.seq LIMIT ?;";
+        std::string &buf = json_buffer();
+        JsonWriter w(buf);
+        long long next = hi;
+        int n = 0;
+        w.begin_object();
+        w.key("changes").begin_array();
+        {
+            PhaseTimer timer(kPhaseDb);
+            sqlite3_stmt *st = nullptr;
+            if (sqlite3_prepare_v2(context.db, sql.c_str(), -1, &st, NULL) == SQLITE_OK) {
+                sqlite3_bind_int64(st, 1, since);
+                sqlite3_bind_int64(st, 2, hi);
+                sqlite3_bind_int(st, 3, limit);
+                while (sqlite3_step(st) == SQLITE_ROW) {
+                    next = sqlite3_column_int64(st, 0);
+                    ++n;
+                    w.begin_object();
+                    w.key("seq").value(next);
+                    w.key("op").value(sqlite3_column_text(st, 1));
+                    w.key("id").value(sqlite3_column_text(st, 2));
+                    if (sqlite3_column_type(st, 3) != SQLITE_NULL) {
+                        w.key("photo");
+                        write_replica_photo(context, w, st, 3);
+                    }
+                    w.end_object();
+                }
+            }
+            sqlite3_finalize(st);
+        }
+        w.end_array();
+        bool more = n == limit;
+        if (!more) next = hi;
+        w.key("seq").value(next);
+        w.key("head").value(hi);
+        w.key("more").raw(more ? "true" : "false");
+        w.end_object();
+        res.set_content(buf.data(), buf.size(), "application/json");
+    });
+
+    // every photo, for a follower's first copy: ?after=<id>&limit= -> {"head":<seq>,"photos":[...],"after":<last id>,"more":bool}
+    // (head is the change log position to stream from once all pages are copied)
+    svr.Get("/api/replication/snapshot", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
+        auto &context = *ctxPtr;
+        if (!replication_authorized(context.cfg, req, res)) return;
+        std::string after = req.get_param_value("after");
+        int limit = 200;
+        try {
+            if (req.has_param("limit")) limit = std::max(1, std::min(1000, std::stoi(req.get_param_value("limit"))));
+        } catch(...) { res.status=400; res.set_content("{\"error\":\"bad_request\"}","application/json"); return; }
+        long long lo = 0, hi = 0;
+        change_log_bounds(context.db, lo, hi);
+        std::string sql = std::string("SELECT ") + kReplicaColumns + " FROM photos p WHERE p.id > ? ORDER BY p.id LIMIT ?;";
+        std::string &buf = json_buffer();
+        JsonWriter w(buf);
+        int n = 0;
+        w.begin_object();
+        w.key("head").value(hi);
+        w.key("photos").begin_array();
+        {
+            PhaseTimer timer(kPhaseDb);
+            sqlite3_stmt *st = nullptr;
+            if (sqlite3_prepare_v2(context.db, sql.c_str(), -1, &st, NULL) == SQLITE_OK) {
+                sqlite3_bind_text(st, 1, after.c_str(), -1, SQLITE_TRANSIENT);
+                sqlite3_bind_int(st, 2, limit);
+                while (sqlite3_step(st) == SQLITE_ROW) {
+                    after = (const char*)sqlite3_column_text(st, 0);
+                    ++n;
+                    write_replica_photo(context, w, st, 0);
+                }
+            }
+            sqlite3_finalize(st);
+        }
+        w.end_array();
+        w.key("after").value(after);
+        w.key("more").raw(n == limit ? "true" : "false");
+        w.end_object();
+        res.set_content(buf.data(), buf.size(), "application/json");
+    });
+
+    // one stored file of a clean photo: ?kind=original|meta|thumb[&ext=jpg|webp|avif]
+    svr.Get(R"(/api/replication/file/(.*))", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
+        auto &context = *ctxPtr;
+        if (!replication_authorized(context.cfg, req, res)) return;
+        std::string id = req.matches[1].str();
+        std::string owner, scope, storage_path, thumb_path, meta_path, scan_status;
+        if (!lookup_photo(context, id, owner, scope, storage_path, thumb_path, meta_path, &scan_status) || scan_status != "clean") { res.status=404; return; }
+        std::string kind = req.get_param_value("kind"), data;
+        if (kind == "original" || kind == "meta") {
+            data = read_file_binary(kind == "original" ? storage_path : meta_path);
+        } else if (kind == "thumb") {
+            const char *ext = thumb_ext(req.has_param("ext") ? req.get_param_value("ext") : "jpg");
+            if (!ext) { res.status=400; res.set_content("{\"error\":\"bad_ext\"}","application/json"); return; }
+            read_stored_thumb(context, id, thumb_path, ext, data);
+        } else { res.status=400; res.set_content("{\"error\":\"bad_kind\"}","application/json"); return; }
+        if (data.empty()) { res.status=404; return; }
+        res.set_content(data, "application/octet-stream");
+    });
+
+    // role and, on a replica, how far behind it is: {"role":"replica","primary","state","applied_seq","primary_seq",
+    // "lag_changes","lag_seconds","photos_applied","files_fetched","bytes_fetched","last_error"}. lag_seconds is the
+    // time since the replica last had everything it had seen on the primary (null before that first happened).
+    // X-Replication-Key, or localhost with debug_endpoints.
+    svr.Get("/api/replication/status", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
+        auto &context = *ctxPtr;
+        if (!is_local_request(context.cfg, req) && !replication_authorized(context.cfg, req, res)) return;
+        std::string &buf = json_buffer();
+        JsonWriter w(buf);
+        w.begin_object();
+        if (!context.replica) {
+            long long lo = 0, hi = 0;
+            change_log_bounds(context.db, lo, hi);
+            w.key("role").value("primary");
+            w.key("seq").value(hi);
+        } else {
+            ReplicaState &rs = *context.replica;
+            static const char *const states[] = { "starting", "snapshot", "streaming", "error" };
+            long long applied = rs.applied_seq, primary = rs.primary_seq, caught_up = rs.caught_up_ms;
+            w.key("role").value("replica");
+            w.key("primary").value(context.cfg.replica_of);
+            w.key("state").value(states[std::min(3, std::max(0, rs.state.load()))]);
+            w.key("applied_seq").value(applied);
+            w.key("primary_seq").value(primary);
+            w.key("lag_changes").value(std::max(0LL, primary - applied));
+            if (caught_up == 0) w.key("lag_seconds").null();
+            else w.key("lag_seconds").value(applied >= primary ? 0LL : (wall_ms() - caught_up) / 1000);
+            w.key("photos_applied").value((long long)rs.photos_applied);
+            w.key("files_fetched").value((long long)rs.files_fetched);
+            w.key("bytes_fetched").value((long long)rs.bytes_fetched);
+            std::lock_guard<std::mutex> lk(rs.m);
+            if (rs.last_error.empty()) w.key("last_error").null();
+            else w.key("last_error").value(rs.last_error);
+        }
+        w.end_object();
+        res.set_content(buf.data(), buf.size(), "application/json");
+    });
+
+    // slowest recent requests with their phase breakdown, localhost with debug_endpoints only: ?n=&min_ms=
+    // -> {"slots":n,"recorded":total,"requests":[{"at":us,"request":"GET /x","status":200,"thread":tid,
+    //     "total_ms":t,"phases":{"auth":ms,...,"other":ms}}]}, slowest first.
+    // ?format=trace returns the same requests as Chrome trace events (chrome://tracing, Perfetto)
+    svr.Get("/debug/slow", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
+        auto &context = *ctxPtr;
+        if (!is_local_request(context.cfg, req)) { res.status=403; res.set_content("{\"error\":\"forbidden\"}","application/json"); return; }
+        if (!context.traces) { res.status=404; res.set_content("{\"error\":\"tracing_disabled\"}","application/json"); return; }
+        int n = 20;
+        double min_ms = 0;
+        try {
+            if (req.has_param("n")) n = std::max(1, std::min(1000, std::stoi(req.get_param_value("n"))));
+            if (req.has_param("min_ms")) min_ms = std::stod(req.get_param_value("min_ms"));
+        } catch (...) { res.status=400; res.set_content("{\"error\":\"bad_params\"}","application/json"); return; }
+        std::vector<TraceRecord> recs = context.traces->snapshot();
+        recs.erase(std::remove_if(recs.begin(), recs.end(), [&](const TraceRecord &r) { return r.total_us < min_ms * 1000; }), recs.end());
+        size_t keep = std::min(recs.size(), (size_t)n);
+        std::partial_sort(recs.begin(), recs.begin() + keep, recs.end(),
+                          [](const TraceRecord &a, const TraceRecord &b) { return a.total_us > b.total_us; });
+        recs.resize(keep);
+        auto ms = [](uint64_t us) { char b[32]; std::snprintf(b, sizeof(b), "%.3f", us / 1000.0); return std::string(b); };
+        std::string &buf = json_buffer();
+        JsonWriter w(buf);
+        if (req.get_param_value("format") == "trace") {
+            // one complete ("X") event per request and one per recorded phase span, on the thread that ran it
+            w.begin_object().key("displayTimeUnit").value("ms").key("traceEvents").begin_array();
+            for (const auto &r : recs) {
+                w.begin_object().key("name").value(r.what).key("cat").value("request").key("ph").value("X")
+                 .key("ts").value((long long)r.start_us).key("dur").value((long long)r.total_us)
+                 .key("pid").value(1LL).key("tid").value((long long)r.tid)
+                 .key("args").begin_object().key("status").value((long long)r.status).end_object().end_object();
+                for (uint32_t i = 0; i < std::min(r.span_count, kTraceSpans); ++i) {
+                    uint64_t sp = r.spans[i];
+                    int phase = (int)(sp >> 61);
+                    if (phase >= kPhaseCount) continue;
+                    w.begin_object().key("name").value(kPhaseNames[phase]).key("cat").value("phase").key("ph").value("X")
+                     .key("ts").value((long long)(r.start_us + ((sp >> 31) & ((1u << 30) - 1))))
+                     .key("dur").value((long long)(sp & ((1u << 31) - 1)))
+                     .key("pid").value(1LL).key("tid").value((long long)r.tid).end_object();
+                }
+            }
+            w.end_array().end_object();
+            res.set_header("Content-Disposition", "attachment; filename=\"slow-requests.trace.json\"");
+            res.set_content(buf.data(), buf.size(), "application/json");
+            return;
+        }
+        w.begin_object();
+        w.key("slots").value((long long)context.traces->size());
+        w.key("recorded").value((long long)context.traces->recorded());
+        w.key("requests").begin_array();
+        for (const auto &r : recs) {
+            w.begin_object();
+            w.key("at").value((long long)r.start_us);
+            w.key("request").value(r.what);
+            w.key("status").value((long long)r.status);
+            w.key("thread").value((long long)r.tid);
+            w.key("total_ms").raw(ms(r.total_us));
+            if (r.span_count > kTraceSpans) w.key("spans_dropped").value((long long)(r.span_count - kTraceSpans));
+            w.key("phases").begin_object();
+            uint64_t accounted = 0;
+            for (int p = 0; p < kPhaseCount; ++p) {
+                accounted += r.phase_us[p];
+                w.key(kPhaseNames[p]).raw(ms(r.phase_us[p]));
+            }
+            w.key("other").raw(ms(r.total_us > accounted ? r.total_us - accounted : 0));
+            w.end_object();
+            w.end_object();
+        }
+        w.end_array();
+        w.end_object();
+        res.set_content(buf.data(), buf.size(), "application/json");
+    });
+
+    // startup warmup progress, localhost with debug_endpoints only -> {"state":"running"|"done","dates","photos","bytes",
+    // "bytes_done","bytes_resident","bytes_read","elapsed_ms","thumb_requests","warm_hits","warmed_share"}.
+    // warmed_share = warm_hits / thumb_requests: how many thumbnail requests since startup were for a photo
+    // in the warmed set. It says whether warmup picked the right photos, not whether the reads hit the page cache.
+    svr.Get("/debug/warmup", [ctxPtr=std::make_shared<AppContext>(ctx)](const Request &req, Response &res) {
+        auto &context = *ctxPtr;
+        if (!is_local_request(context.cfg, req)) { res.status=403; res.set_content("{\"error\":\"forbidden\"}","application/json"); return; }
+        if (!context.warmup) { res.status=404; res.set_content("{\"error\":\"warmup_disabled\"}","application/json"); return; }
+        const Warmup &wu = *context.warmup;
+        static const char *const states[] = { "waiting", "running", "done" };
+        long long end = wu.state == 2 ? wu.finished_ms.load()
+                      : (long long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        uint64_t requests = wu.thumb_requests, hits = wu.warm_hits;
+        char share[32];
+        std::snprintf(share, sizeof(share), "%.4f", requests ? (double)hits / (double)requests : 0.0);
+        std::string &buf = json_buffer();
+        JsonWriter w(buf);
+        w.begin_object();
+        w.key("state").value(states[std::min(2, std::max(0, wu.state.load()))]);
+        w.key("dates").value((long long)wu.dates);
+        w.key("photos").value((long long)wu.photos);
+        w.key("bytes").value((long long)wu.bytes);
+        w.key("bytes_done").value((long long)wu.bytes_done);
+        w.key("bytes_resident").value((long long)wu.bytes_resident);
+        w.key("bytes_read").value((long long)wu.bytes_read);
+        w.key("elapsed_ms").value(wu.state == 0 ? 0LL : end - wu.started_ms);
+        w.key("thumb_requests").value((long long)requests);
+        w.key("warm_hits").value((long long)hits);
+        w.key("warmed_share").raw(share);
+        w.end_object();
+        res.set_content(buf.data(), buf.size(), "application/json");
+    });
+
+    // static web files from memory; registered last so the catch-all never shadows an API route
+    auto web_assets = std::make_shared<std::map<std::string, StaticAsset>>();
+    std::string web_dir = ctx.cfg.web_dir;
+    if (web_dir.empty()) load_embedded_assets(*web_assets);
+    else std::cout << "Serving web files from " << web_dir << std::endl;
+    svr.Get(R"(/(.*))", [web_assets, web_dir](const Request &req, Response &res) {
+        std::string path = req.path;
+        if (path.empty() || path.back() == '/') path += "index.html";
+        if (!web_dir.empty()) {
+            StaticAsset a;
+            if (!load_static_file(web_dir, path, a)) { res.status = 404; return; }
+            serve_static_asset(a, req, res);
+            return;
+        }
+        auto it = web_assets->find(path);
+        if (it == web_assets->end()) { res.status = 404; return; }
+        serve_static_asset(it->second, req, res);
+    });
+
+    std::cout << "Server started on port " << ctx.cfg.port << (tls ? " (HTTPS)" : "") << "..." << std::endl;
     svr.listen("0.0.0.0", ctx.cfg.port);
     if (ctx.db) sqlite3_close(ctx.db);
     return 0;
@@ -0,0 +1,61 @@
+#!/bin/bash
+# tls_bench.sh — handshake rate and time-to-first-byte of the HTTPS mode, against a local server.
+#
+#   ./tls_bench.sh cert <dir>                      self-signed localhost certificate for tls_cert / tls_key
+#   ./tls_bench.sh run <host:port> [seconds] [path] full vs resumed handshakes, TTFB cold / resumed / keep-alive
+#
+# Needs openssl and curl. Start the server with the generated cert/key in config.json first.
+set -e
+
+cmd=$1
+case "$cmd" in
+cert)
+    dir=${2:-.}
+    mkdir -p "$dir"
+    openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 365 \
+        -subj "/CN=localhost" -addext "subjectAltName=DNS:localhost,IP:127.0.0.1" \
+        -keyout "$dir/key.pem" -out "$dir/cert.pem" 2>/dev/null
+    echo "wrote $dir/cert.pem and $dir/key.pem"
+    echo "config.json: \"tls_cert\": \"$dir/cert.pem\", \"tls_key\": \"$dir/key.pem\""
+    ;;
+run)
+    target=${2:?host:port}
+    secs=${3:-5}
+    path=${4:-/}
+    url="https://$target$path"
+    tmp=$(mktemp -d)
+    trap 'rm -rf "$tmp"' EXIT
+
+    echo "== handshakes ($secs s each, TLS 1.3 and 1.2)"
+    for proto in -tls1_3 -tls1_2; do
+        for mode in -new -reuse; do
+            rate=$(openssl s_time -connect "$target" $proto $mode -time "$secs" -www "$path" 2>/dev/null \
+                   | awk '/in [0-9]+ real seconds/ { c = $1; r = $4 } END { if (r) printf "%.0f connections/s", c / r }')
+            printf '  %-8s %-7s %s\n' "$proto" "$mode" "${rate:-failed}"
+        done
+    done
+
+    # curl times: handshake done (appconnect) and first response byte (starttransfer), in ms
+    n=20
+    fmt='%{time_appconnect} %{time_starttransfer}\n'
+    summarize() { awk -v label="$1" '$1 > 0 || $2 > 0 { h += $1; t += $2; c++ }
+        END { if (c) printf "  %-24s handshake %6.2f ms  ttfb %6.2f ms  (%d requests)\n", label, h/c*1000, t/c*1000, c }' "$2"; }
+
+    echo "== time to first byte ($url)"
+    for i in $(seq $n); do curl -sk -o /dev/null -w "$fmt" "$url"; done > "$tmp/cold"
+    summarize "new connection" "$tmp/cold"
+
+    # one curl process keeps its TLS sessions: with Connection: close every request after the first
+    # is a new connection with a resumed handshake, without it they all share one keep-alive connection
+    args=()
+    for i in $(seq $((n + 1))); do args+=(-o /dev/null "$url"); done
+    curl -sk -H 'Connection: close' -w "$fmt" "${args[@]}" | tail -n +2 > "$tmp/resumed"
+    summarize "resumed connection" "$tmp/resumed"
+    curl -sk -w "$fmt" "${args[@]}" | tail -n +2 | awk '{ print 0, $2 }' > "$tmp/keepalive"
+    summarize "keep-alive" "$tmp/keepalive"
+    ;;
+*)
+    sed -n '2,7p' "$0"
+    exit 1
+    ;;
+esac
@@ -0,0 +1,18 @@
+// web_assets.h
+// The web/ bundle compiled into the server. web_assets.cpp is generated at build time by embed_web.
+#pragma once
+#include <cstddef>
+
+struct EmbeddedAsset {
+    const char *path;               // "/app.js", "/icons/gear.svg", ...
+    const char *etag;               // quoted, first 16 hex chars of the SHA-256 of body
+    const unsigned char *body;
+    size_t body_size;
+    const unsigned char *gzip;      // nullptr when compression did not make it smaller
+    size_t gzip_size;
+    const unsigned char *br;        // nullptr without brotli or when it did not help
+    size_t br_size;
+};
+
+extern const EmbeddedAsset kWebAssets[];
+extern const size_t kWebAssetCount;
@@ -17,8 +17,17 @@ let token = localStorage.getItem('jwt') || null;
 let currentScope = 'shared';
 let loading = false;
 let loadedBlocks = 0;
+let lastBlockDate = null; // keyset cursor: oldest date block rendered so far
+let jumpDate = null; // set by the timeline scrubber: first page starts at this date
 let allPhotos = []; // flat list of photos in DOM order for global navigation
 let nextUploadScope = null; // used when upload initiated via context menu
+let changeSeq = null; // /api/changes cursor: everything up to it is already on screen
+let changeSource = null; // EventSource on /api/events
+let changePollTimer = null; // polls /api/changes while the stream is down
+let changeRetryTimer = null; // reopens the stream
+let changeRetryDelay = 5000;
+let changeSyncing = false;
+let changeSyncAgain = false;
 
 const blocksEl = document.getElementById('blocks');
 const loader = document.getElementById('loader');
@@ -118,14 +127,18 @@ async function apiPost(path, body, isForm = false) {
   return res;
 }
 
-async function loadBlocks(start = 0, count = BLOCKS_PER_LOAD) {
+async function loadBlocks(count = BLOCKS_PER_LOAD) {
   if (loading) return;
   loading = true;
   loader.classList.remove('hidden');
   try {
-    const data = await apiGet(`/api/blocks?scope=${currentScope}&start=${start}&count=${count}`);
+    let url = `/api/blocks?scope=${currentScope}&count=${count}`;
+    if (lastBlockDate) url += `&before=${encodeURIComponent(lastBlockDate)}`;
+    else if (jumpDate) url += `&from=${encodeURIComponent(jumpDate)}`;
+    const data = await apiGet(url);
     renderBlocks(data);
     loadedBlocks += (data && data.length) ? data.length : 0;
+    if (data && data.length) lastBlockDate = data[data.length - 1].date;
   } catch (e) {
     console.error(e);
   } finally {
@@ -134,6 +147,218 @@ async function loadBlocks(start = 0, count = BLOCKS_PER_LOAD) {
   }
 }
 
+// Lazy thumbnail loading: swap placeholder -> real thumbnail when a tile nears the viewport
+const thumbObserver = ('IntersectionObserver' in window) ? new IntersectionObserver((entries) => {
+  for (const e of entries) {
+    if (!e.isIntersecting) continue;
+    thumbObserver.unobserve(e.target);
+    loadRealThumb(e.target);
+  }
+}, { rootMargin: '400px 0px' }) : null;
+
+function observeThumb(img) {
+  if (thumbObserver) thumbObserver.observe(img);
+  else loadRealThumb(img);
+}
+
+function loadRealThumb(img) {
+  const src = img.dataset.thumbSrc;
+  if (!src) return;
+  delete img.dataset.thumbSrc;
+  const onLoad = () => {
+    if (img.src.startsWith('data:')) return; // the placeholder itself finished decoding
+    img.classList.remove('lqip');
+    img.removeEventListener('load', onLoad);
+  };
+  img.addEventListener('load', onLoad);
+  if (img.dataset.photoId) queueThumbBatch(img, src);
+  else setImageSrcWithAuth(img, src);
+}
+
+// Batched thumbnails: tiles that become visible together are fetched with one
+// /api/thumbs?ids=... request (binary pack, see server) instead of one request each.
+const THUMB_BATCH_MAX = 60;
+let thumbBatch = [];
+let thumbBatchTimer = null;
+let thumbBlobUrls = [];
+
+function queueThumbBatch(img, fallbackSrc) {
+  thumbBatch.push({ img, id: img.dataset.photoId, fallbackSrc });
+  if (thumbBatch.length >= THUMB_BATCH_MAX) flushThumbBatch();
+  else if (!thumbBatchTimer) thumbBatchTimer = setTimeout(flushThumbBatch, 16);
+}
+
+async function flushThumbBatch() {
+  clearTimeout(thumbBatchTimer);
+  thumbBatchTimer = null;
+  const batch = thumbBatch;
+  thumbBatch = [];
+  if (!batch.length) return;
+  const byId = new Map();
+  for (const item of batch) {
+    if (!byId.has(item.id)) byId.set(item.id, []);
+    byId.get(item.id).push(item);
+  }
+  const pending = new Set(byId.keys());
+  try {
+    // fetch() sends Accept: */*, unlike <img>; ask for the smaller encodings explicitly
+    const headers = { 'Accept': 'image/avif,image/webp,image/jpeg;q=0.8' };
+    if (token) headers['Authorization'] = 'Bearer ' + token;
+    const ids = Array.from(byId.keys()).map(encodeURIComponent).join(',');
+    const res = await fetch(`/api/thumbs?ids=${ids}`, { headers, credentials: 'same-origin' });
+    if (res.ok) {
+      const buf = new Uint8Array(await res.arrayBuffer());
+      const view = new DataView(buf.buffer, buf.byteOffset, buf.byteLength);
+      const dec = new TextDecoder();
+      let i = 0;
+      while (i + 2 <= buf.length) {
+        const idLen = view.getUint16(i); i += 2;
+        const id = dec.decode(buf.subarray(i, i + idLen)); i += idLen;
+        const mimeLen = view.getUint16(i); i += 2;
+        const mime = dec.decode(buf.subarray(i, i + mimeLen)); i += mimeLen;
+        const len = view.getUint32(i); i += 4;
+        const data = buf.subarray(i, i + len); i += len;
+        if (!len || !byId.has(id)) continue;
+        const url = URL.createObjectURL(new Blob([data], { type: mime }));
+        thumbBlobUrls.push(url);
+        for (const item of byId.get(id)) item.img.src = url;
+        pending.delete(id);
+      }
+    }
+  } catch (e) {
+    console.warn('thumb batch failed', e);
+  }
+  // anything the pack did not deliver falls back to the per-image path
+  for (const id of pending) {
+    for (const item of byId.get(id)) setImageSrcWithAuth(item.img, item.fallbackSrc);
+  }
+}
+
+function revokeThumbBlobs() {
+  for (const url of thumbBlobUrls) { try { URL.revokeObjectURL(url); } catch(e) {} }
+  thumbBlobUrls = [];
+}
+
+// one photo tile as rendered in a date block (also used for tiles added by the change feed)
+function createPhotoTile(p, blockDate) {
+  const t = document.createElement('div');
+  t.className = 'thumb';
+  if (p.id !== undefined && p.id !== null) t.dataset.photoId = String(p.id);
+  t.style.height = (M_HEIGHT) + 'px';
+  const img = document.createElement('img');
+  img.decoding = 'async';
+  // paint the inline placeholder right away; the real thumbnail is requested
+  // only once the tile scrolls near the viewport (see thumbObserver)
+  img.dataset.thumbSrc = ensureThumbUrl(p.thumb_url, (p.scope||""));
+  if (p.id !== undefined && p.id !== null) img.dataset.photoId = String(p.id);
+  if (p.placeholder) {
+    img.src = p.placeholder;
+    img.classList.add('lqip');
+  }
+  observeThumb(img);
+  img.alt = p.orig_name || 'photo';
+  // store potential full url and original dimensions if provided by server
+  if (p.full_url) t.dataset.fullUrl = p.full_url;
+  if (p.orig_width) t.dataset.origWidth = String(p.orig_width);
+  if (p.orig_height) t.dataset.origHeight = String(p.orig_height);
+
+  img.addEventListener('load', () => {
+    try {
+      const aspect = img.naturalWidth && img.naturalHeight ? (img.naturalWidth / img.naturalHeight) : 1;
+      const w = Math.max(40, Math.round(M_HEIGHT * aspect));
+      t.style.width = w + 'px';
+      img.style.height = '100%';
+      img.style.width = 'auto';
+    } catch(e) {}
+  });
+
+  const badge = document.createElement('span');
+  badge.className = 'badge';
+  badge.textContent = '';
+  t.appendChild(img);
+  t.appendChild(badge);
+
+  // Also attach block-date for potential lookup from thumb
+  if (blockDate) t.dataset.blockDate = blockDate;
+
+  t.addEventListener('click', () => openOverlayById(p.id));
+
+  t.addEventListener('contextmenu', (e) => {
+    e.preventDefault();
+    showContextMenuForThumb(e, t, p);
+  });
+
+  return t;
+}
+
+function photoListEntry(p, blockDate) {
+  return { id: p.id, full_url: p.full_url || null, thumb_url: p.thumb_url, orig_name: p.orig_name, scope: p.scope || 'shared', blockDate: blockDate || null };
+}
+
+const EXPORT_MAX_IDS = 5000; // kExportMaxIds in server/main.cpp
+
+// ZIP download via a form POST into a hidden frame: the browser streams the archive to disk,
+// long id lists do not have to fit into a URL, and an error page does not replace the app.
+// A download does not load the frame; an error answer (JSON) does, and is shown in an alert.
+function downloadExport(fields) {
+  let frame = document.getElementById('export-frame');
+  if (!frame) {
+    frame = document.createElement('iframe');
+    frame.id = 'export-frame';
+    frame.name = 'export-frame';
+    frame.style.display = 'none';
+    frame.addEventListener('load', () => {
+      let text = '';
+      try { text = frame.contentDocument && frame.contentDocument.body ? frame.contentDocument.body.textContent : ''; } catch (e) {}
+      if (!text) return; // the initial about:blank
+      let err = text;
+      try { err = JSON.parse(text).error || text; } catch (e) {}
+      const messages = {
+        not_found: 'нет доступных фото',
+        too_many_ids: 'выбрано больше ' + EXPORT_MAX_IDS + ' фото',
+        auth_required: 'нужно войти заново',
+      };
+      alert('Ошибка скачивания: ' + (messages[err] || err));
+    });
+    document.body.appendChild(frame);
+  }
+  const form = document.createElement('form');
+  form.method = 'POST';
+  form.action = '/api/export';
+  form.target = 'export-frame';
+  form.style.display = 'none';
+  const all = Object.assign({}, fields);
+  if (token) all.t = token;
+  for (const k of Object.keys(all)) {
+    const input = document.createElement('input');
+    input.type = 'hidden';
+    input.name = k;
+    input.value = all[k];
+    form.appendChild(input);
+  }
+  document.body.appendChild(form);
+  form.submit();
+  form.remove();
+}
+
+function addBlockExport(block, dateStr) {
+  const btn = document.createElement('button');
+  btn.type = 'button';
+  btn.className = 'block-export';
+  btn.title = 'Скачать ' + dateStr + ' (ZIP)';
+  const icon = document.createElement('img');
+  icon.src = '/icons/download-black.svg';
+  icon.alt = 'Скачать';
+  icon.width = 16;
+  icon.height = 16;
+  btn.appendChild(icon);
+  btn.addEventListener('click', (e) => {
+    e.stopPropagation();
+    downloadExport({ date: dateStr, scope: currentScope });
+  });
+  block.appendChild(btn);
+}
+
 function renderBlocks(blocks) {
   if (!blocks || !blocks.length) {
     if (loadedBlocks === 0) {
@@ -152,59 +377,21 @@ function renderBlocks(blocks) {
 
     for (const p of b.photos) {
       if (p.scope === 'personal' && currentScope !== 'personal') continue;
+      // not scanned yet, quarantined or unscannable: shown once a change says it is clean
+      if (p.scan_status) continue;
 
       if (p.id !== undefined && p.id !== null) {
         const exists = allPhotos.find(x => String(x.id) === String(p.id));
         if (exists) continue;
       }
 
-      const t = document.createElement('div');
-      t.className = 'thumb';
-      if (p.id !== undefined && p.id !== null) t.dataset.photoId = String(p.id);
-      t.style.height = (M_HEIGHT) + 'px';
-      const img = document.createElement('img');
-      img.loading = 'lazy';
-      img.decoding = 'async';
-      setImageSrcWithAuth(img, ensureThumbUrl(p.thumb_url, (p.scope||previewObj.scope||"")));
-      img.alt = p.orig_name || 'photo';
-      // store potential full url and original dimensions if provided by server
-      if (p.full_url) t.dataset.fullUrl = p.full_url;
-      if (p.orig_width) t.dataset.origWidth = String(p.orig_width);
-      if (p.orig_height) t.dataset.origHeight = String(p.orig_height);
-
-      img.addEventListener('load', () => {
-        try {
-          const aspect = img.naturalWidth && img.naturalHeight ? (img.naturalWidth / img.naturalHeight) : 1;
-          const w = Math.max(40, Math.round(M_HEIGHT * aspect));
-          t.style.width = w + 'px';
-          img.style.height = '100%';
-          img.style.width = 'auto';
-        } catch(e) {}
-      });
-
-      const badge = document.createElement('span');
-      badge.className = 'badge';
-      badge.textContent = '';
-      t.appendChild(img);
-      t.appendChild(badge);
-
-      // Also attach block-date for potential lookup from thumb
-      if (b.date) t.dataset.blockDate = b.date;
-
-      allPhotos.push({ id: p.id, full_url: p.full_url || null, thumb_url: p.thumb_url, orig_name: p.orig_name, scope: p.scope || 'shared', blockDate: b.date || null });
-
-      t.addEventListener('click', () => openOverlayById(p.id));
-
-      t.addEventListener('contextmenu', (e) => {
-        e.preventDefault();
-        showContextMenuForThumb(e, t, p);
-      });
-
-      thumbs.appendChild(t);
+      thumbs.appendChild(createPhotoTile(p, b.date));
+      allPhotos.push(photoListEntry(p, b.date));
     }
 
     block.appendChild(date);
     block.appendChild(thumbs);
+    addBlockExport(block, b.date);
     if (thumbs.children.length > 0) blocksEl.appendChild(block);
   }
 }
@@ -836,11 +1023,214 @@ document.getElementById('btn-all').addEventListener('click', () => {
   resetAndLoad();
 });
 
-function resetAndLoad() {
+async function resetAndLoad() {
+  blocksEl.innerHTML = '';
+  revokeThumbBlobs();
+  loadedBlocks = 0;
+  lastBlockDate = null;
+  jumpDate = null;
+  allPhotos = [];
+  // take the change-log position before the blocks, so nothing logged in between is missed
+  // (changes that the blocks already contain are skipped when applied)
+  stopChangeFeed();
+  const scope = currentScope;
+  const head = await apiGet(`/api/changes?scope=${scope}`).catch(() => null);
+  if (scope !== currentScope) return;
+  loadBlocks();
+  loadTimeline();
+  if (head && typeof head.seq === 'number') startChangeFeed(head.seq);
+}
+
+// --- change feed: /api/events says "something changed", /api/changes?since= says what ---
+function stopChangeFeed() {
+  pauseChangeFeed();
+  changeSeq = null;
+}
+
+// closes the stream and timers but keeps the cursor, so showing the tab again resumes from it
+function pauseChangeFeed() {
+  if (changeSource) changeSource.close();
+  changeSource = null;
+  clearInterval(changePollTimer);
+  clearTimeout(changeRetryTimer);
+  changePollTimer = null;
+  changeRetryTimer = null;
+  changeRetryDelay = 5000;
+}
+
+// every open stream holds a server thread, so only a visible tab keeps one: a hidden tab costs
+// nothing and pulls what it missed from /api/changes when shown again
+document.addEventListener('visibilitychange', () => {
+  if (changeSeq === null) return;
+  if (document.hidden) { pauseChangeFeed(); return; }
+  syncChanges();
+  openChangeStream();
+});
+
+function startChangeFeed(seq) {
+  changeSeq = seq;
+  openChangeStream();
+}
+
+// EventSource gives up for good on a 503 (server at max_event_streams) or a 401 (the ?t= token
+// expired), and on a network drop it retries the old URL. So on any error: close it, poll
+// /api/changes meanwhile and reopen with the current token after a growing delay.
+function openChangeStream() {
+  changeRetryTimer = null;
+  if (changeSeq === null || document.hidden || changeSource) return;
+  if (!('EventSource' in window)) { startChangePolling(); return; }
+  let url = `/api/events?scope=${currentScope}&since=${changeSeq}`;
+  if (token) url += '&t=' + encodeURIComponent(token);
+  const source = new EventSource(url);
+  changeSource = source;
+  source.onopen = () => {
+    changeRetryDelay = 5000;
+    clearInterval(changePollTimer);
+    changePollTimer = null;
+  };
+  source.onmessage = () => syncChanges();
+  source.onerror = () => {
+    if (source !== changeSource) return;
+    source.close();
+    changeSource = null;
+    startChangePolling();
+    changeRetryTimer = setTimeout(openChangeStream, changeRetryDelay);
+    changeRetryDelay = Math.min(changeRetryDelay * 2, 60000);
+  };
+}
+
+function startChangePolling() {
+  syncChanges();
+  if (!changePollTimer) changePollTimer = setInterval(syncChanges, 15000);
+}
+
+async function syncChanges() {
+  if (changeSyncing) { changeSyncAgain = true; return; }
+  changeSyncing = true;
+  try {
+    const scope = currentScope;
+    for (;;) {
+      if (changeSeq === null) break;
+      const headers = {};
+      if (token) headers['Authorization'] = 'Bearer ' + token;
+      const res = await fetch(`/api/changes?scope=${scope}&since=${changeSeq}`, { headers, credentials: 'same-origin' });
+      if (scope !== currentScope || changeSeq === null) break;
+      if (res.status === 410) { resetAndLoad(); break; } // fell behind the retained log
+      if (!res.ok) break;
+      const data = await res.json();
+      for (const c of data.changes) applyChange(c);
+      changeSeq = data.seq;
+      if (data.more) continue;
+      if (!changeSyncAgain) break;
+      changeSyncAgain = false;
+    }
+  } catch (e) {
+    console.warn('change sync failed', e);
+  } finally {
+    changeSyncing = false;
+  }
+}
+
+function applyChange(c) {
+  if (c.op === 'del') { removePhotoTile(c.id); return; }
+  const p = c.photo;
+  if (!p) return; // deleted again further down the log
+  const existing = document.querySelector('.thumb[data-photo-id="' + CSS.escape(String(p.id)) + '"]');
+  if (p.scan_status) {
+    // an uploader keeps their own pending tile; quarantined or unscannable ones go away
+    if (existing && p.scan_status !== 'pending_scan') removePhotoTile(p.id);
+    return;
+  }
+  if (existing) {
+    if (c.op === 'update') {
+      // scan finished: fetch the real thumbnail again
+      const img = existing.querySelector('img');
+      if (img) { img.dataset.thumbSrc = ensureThumbUrl(p.thumb_url, p.scope || ''); loadRealThumb(img); }
+    }
+    return;
+  }
+  if (p.scope === 'personal' && currentScope !== 'personal') return;
+  // only dates inside the rendered range; older ones arrive with the next page anyway
+  if (lastBlockDate && c.date < lastBlockDate) return;
+  if (jumpDate && c.date > jumpDate) return;
+  const block = dateBlockFor(c.date);
+  const thumbs = block.querySelector('.thumbs');
+  const t = createPhotoTile(p, c.date);
+  // newest first, like /api/blocks
+  thumbs.insertBefore(t, thumbs.firstChild);
+  const tiles = Array.from(blocksEl.querySelectorAll('.thumb'));
+  const next = tiles[tiles.indexOf(t) + 1];
+  const at = next ? allPhotos.findIndex(x => String(x.id) === String(next.dataset.photoId)) : -1;
+  if (at === -1) allPhotos.push(photoListEntry(p, c.date));
+  else allPhotos.splice(at, 0, photoListEntry(p, c.date));
+}
+
+// the block section for a date, created in date order (newest first) when missing
+function dateBlockFor(dateStr) {
+  let before = null;
+  for (const b of blocksEl.querySelectorAll('section.block')) {
+    const d = b.querySelector('.date');
+    const bd = d ? d.textContent : '';
+    if (bd === dateStr) return b;
+    if (!before && bd < dateStr) before = b;
+  }
+  const empty = blocksEl.querySelector(':scope > .loader');
+  if (empty) empty.remove();
+  const block = document.createElement('section');
+  block.className = 'block';
+  const date = document.createElement('div');
+  date.className = 'date';
+  date.textContent = dateStr;
+  const thumbs = document.createElement('div');
+  thumbs.className = 'thumbs';
+  block.appendChild(date);
+  block.appendChild(thumbs);
+  addBlockExport(block, dateStr);
+  blocksEl.insertBefore(block, before);
+  if (!lastBlockDate) lastBlockDate = dateStr;
+  return block;
+}
+
+// Timeline scrubber: year/month list from /api/timeline, clicking a month jumps to it
+const timelineEl = document.getElementById('timeline');
+
+async function loadTimeline() {
+  if (!timelineEl) return;
+  timelineEl.innerHTML = '';
+  const data = await apiGet(`/api/timeline?scope=${currentScope}`);
+  if (!data || !data.years) return;
+  for (const y of data.years) {
+    const yl = document.createElement('button');
+    yl.type = 'button';
+    yl.className = 'timeline-year';
+    yl.textContent = y.year;
+    yl.title = y.year + ': ' + y.count + ' фото';
+    if (y.months.length) yl.addEventListener('click', () => jumpToDate(y.months[0].days[0].date));
+    timelineEl.appendChild(yl);
+    for (const m of y.months) {
+      const ml = document.createElement('button');
+      ml.type = 'button';
+      ml.className = 'timeline-month';
+      ml.textContent = m.month.slice(5);
+      ml.title = m.month + ': ' + m.count + ' фото';
+      // days are newest first, so days[0] is the top of this month
+      ml.addEventListener('click', () => jumpToDate(m.days[0].date));
+      timelineEl.appendChild(ml);
+    }
+  }
+}
+
+function jumpToDate(date) {
   blocksEl.innerHTML = '';
+  revokeThumbBlobs();
   loadedBlocks = 0;
+  lastBlockDate = null;
+  jumpDate = date;
   allPhotos = [];
-  loadBlocks(0);
+  window.scrollTo(0, 0);
+  const main = document.querySelector('main.main');
+  if (main) main.scrollTop = 0;
+  loadBlocks();
 }
 
 // login/upload UI
@@ -1013,6 +1403,17 @@ function showContextMenuForThumb(e, thumbEl, photoObj) {
   contextTarget = { type: 'thumb', photoId: pid, thumbEl };
 }
 
+// drop a deleted photo's tile (and its block if it was the last one) without reloading
+function removePhotoTile(photoId) {
+  const thumbEl = document.querySelector('.thumb[data-photo-id="' + CSS.escape(String(photoId)) + '"]');
+  if (thumbEl) {
+    const block = thumbEl.closest('.block');
+    if (thumbEl.parentNode) thumbEl.parentNode.removeChild(thumbEl);
+    if (block && !block.querySelectorAll('.thumb').length && block.parentNode) block.parentNode.removeChild(block);
+  }
+  allPhotos = allPhotos.filter(p => String(p.id) !== String(photoId));
+}
+
 async function deletePhotoByThumb(thumbEl, photoId) {
   if (!thumbEl) return;
   if (!photoId) {
@@ -1181,6 +1582,7 @@ function uploadWithPreview(file, scopeArg) {
   thumbs.appendChild(t);
   block.appendChild(date);
   block.appendChild(thumbs);
+  addBlockExport(block, dateStr);
 
   // Try to find an existing block with the same date. If found, insert the thumb into it
   const blocksEl = document.querySelector('#blocks') || document.querySelector('.blocks') || document.body;
@@ -1285,6 +1687,17 @@ function uploadWithPreview(file, scopeArg) {
         if (overlayDiv && overlayDiv.parentNode) overlayDiv.parentNode.removeChild(overlayDiv);
         t.classList.remove('uploading');
 
+        // the change feed may have rendered this photo already; keep that tile
+        const newId = json && (json.photo ? json.photo.id : json.id);
+        const dup = newId ? document.querySelector('.thumb[data-photo-id="' + CSS.escape(String(newId)) + '"]') : null;
+        if (dup && dup !== t) {
+          const ownBlock = t.closest('.block');
+          if (t.parentNode) t.parentNode.removeChild(t);
+          if (ownBlock && !ownBlock.querySelectorAll('.thumb').length && ownBlock.parentNode) ownBlock.parentNode.removeChild(ownBlock);
+          allPhotos = allPhotos.filter(x => x !== previewObj);
+          return;
+        }
+
         if (json && json.photo) {
           const p = json.photo;
           if (p.id !== undefined && p.id !== null) {
@@ -1338,7 +1751,7 @@ function uploadWithPreview(file, scopeArg) {
 window.addEventListener('scroll', () => {
   if (loading) return;
   if ((window.innerHeight + window.scrollY) >= document.body.offsetHeight - 600) {
-    loadBlocks(loadedBlocks);
+    loadBlocks();
   }
 });
 
@@ -1394,7 +1807,7 @@ if (token) {
   showLoggedOut();
 }
 setActiveButton(currentScope);
-loadBlocks(0);
+resetAndLoad();
 
 
 
@@ -1548,6 +1961,12 @@ if (typeof setImageSrcWithAuth === 'undefined') {
         const headers = {};
         if (typeof token !== 'undefined' && token) headers['Authorization'] = 'Bearer ' + token;
         const res = await fetch(url, { method: 'GET', headers: headers, credentials: 'same-origin' });
+        if (res.status === 202) {
+          // still being virus-scanned: try again once the server says so
+          const wait = (parseInt(res.headers.get('Retry-After'), 10) || 5) * 1000;
+          setTimeout(() => { if (imgEl.isConnected) setImageSrcWithAuth(imgEl, url); }, wait);
+          return;
+        }
         if (!res.ok) {
           // nothing more we can do; leave broken image
           console.warn('setImageSrcWithAuth: fetch failed', res.status, url);
@@ -1900,6 +2319,18 @@ function isLoggedIn() {
   trashImg.width = 20;
   trashImg.height = 20;
   trashBtn.appendChild(trashImg);
+  const exportBtn = document.createElement('button');
+  exportBtn.type = 'button';
+  exportBtn.id = 'select-export-btn';
+  exportBtn.className = 'top-btn select-export';
+  exportBtn.title = 'Скачать выбранные (ZIP)';
+  const exportImg = document.createElement('img');
+  exportImg.src = '/icons/download-black.svg';
+  exportImg.alt = 'Скачать';
+  exportImg.width = 20;
+  exportImg.height = 20;
+  exportBtn.appendChild(exportImg);
+  selectRight.appendChild(exportBtn);
   selectRight.appendChild(trashBtn);
 
   // append these containers to header (left and right)
@@ -1947,20 +2378,43 @@ function isLoggedIn() {
     clearAllSelection();
   });
 
+  exportBtn.addEventListener('click', (e)=>{
+    e.stopPropagation();
+    if (selectedSet.size === 0) return;
+    if (selectedSet.size > EXPORT_MAX_IDS) return alert('Можно скачать не больше ' + EXPORT_MAX_IDS + ' фото за раз');
+    downloadExport({ ids: Array.from(selectedSet).join(',') });
+  });
+
   trashBtn.addEventListener('click', async (e)=>{
     e.stopPropagation();
     const n = selectedSet.size;
     if (n === 0) return;
     const ok = await showConfirm('Вы уверены что вы хотите удалить ' + n + ' фото?');
     if (!ok) return;
-    // delete selected photos sequentially to keep server/load stable
+    // one request per 1000 photos: the server removes them in a single transaction
     const ids = Array.from(selectedSet);
-    for (const id of ids){
+    for (let i = 0; i < ids.length; i += 1000){
       try {
-        const thumb = document.querySelector('.thumb[data-photo-id="'+CSS.escape(String(id))+'"]');
-        await deletePhotoByThumb(thumb, id);
+        const headers = { 'Content-Type': 'application/json' };
+        if (token) headers['Authorization'] = 'Bearer ' + token;
+        const res = await fetch('/api/photos/delete', {
+          method: 'POST',
+          headers,
+          credentials: 'same-origin',
+          body: JSON.stringify({ ids: ids.slice(i, i + 1000) })
+        });
+        if (!res.ok) {
+          const txt = await res.text().catch(() => 'Ошибка');
+          alert('Ошибка удаления: ' + txt);
+          break;
+        }
+        const out = await res.json();
+        for (const id of out.deleted) removePhotoTile(id);
+        if (out.failed.length) console.warn('Not deleted', out.failed);
       } catch(err){
-        console.error('Error deleting',id,err);
+        console.error('Error deleting', err);
+        alert('Network error: ' + err.message);
+        break;
       }
     }
     // clear selection